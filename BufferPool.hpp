@@ -0,0 +1,69 @@
+#pragma once
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <vector>
+
+#include <cstdint>
+
+// Keeps the buffers of finished tasks around, so the next files do not need fresh
+// (page faulting) allocations. Holds at most max_bytes.
+class BufferPool
+{
+private:
+	std::mutex _mutex;
+	std::multimap<size_t, std::vector<uint8_t>> _free; // by capacity
+	size_t _free_bytes = 0;
+	const size_t _max_bytes;
+
+	std::atomic<size_t> _reused = 0;
+	std::atomic<size_t> _allocated = 0;
+
+public:
+	BufferPool(size_t max_bytes) :
+		_max_bytes(max_bytes)
+	{
+	}
+
+	BufferPool(const BufferPool&) = delete;
+	BufferPool& operator=(const BufferPool&) = delete;
+
+	std::vector<uint8_t> take(size_t size)
+	{
+		std::vector<uint8_t> buffer;
+		{
+			std::lock_guard lock(_mutex);
+			// don't waste a much larger buffer, its capacity counts against the memory budget
+			auto it = _free.lower_bound(size);
+			if (it != _free.end() && it->first <= size + size / 4)
+			{
+				buffer = std::move(it->second);
+				_free_bytes -= it->first;
+				_free.erase(it);
+			}
+		}
+		if (buffer.capacity())
+			_reused++;
+		else if (size)
+			_allocated++;
+		buffer.resize(size);
+		return buffer;
+	}
+
+	void give(std::vector<uint8_t>&& buffer)
+	{
+		std::vector<uint8_t> b = std::move(buffer); // freed here if the pool is full
+		size_t capacity = b.capacity();
+		if (capacity == 0)
+			return;
+		std::lock_guard lock(_mutex);
+		if (_free_bytes + capacity > _max_bytes)
+			return;
+		b.clear();
+		_free_bytes += capacity;
+		_free.emplace(capacity, std::move(b));
+	}
+
+	size_t reused() const { return _reused; }
+	size_t allocated() const { return _allocated; }
+};
\ No newline at end of file
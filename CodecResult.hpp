@@ -0,0 +1,36 @@
+#pragma once
+#include <cstddef>
+
+enum class codec_error
+{
+	none,
+	output_too_small,  // the output span cannot take the result, nothing was written
+	truncated,         // the input ended early, the rest of the output is zeroed
+	invalid_reference, // ZLC2 back-reference before the start of the output
+	invalid_run,       // RLE0 run that does not fit into the input or output
+	invalid_argument   // e.g. a compression level out of range, nothing was written
+};
+
+// Result of the span based codec functions: the bytes written to the output or what went wrong.
+struct codec_result
+{
+	size_t size = 0;
+	codec_error error = codec_error::none;
+	size_t consumed = 0; // input bytes used by decompress, when it ends early that is all of them
+
+	explicit operator bool() const { return error == codec_error::none; }
+
+	const char* message() const
+	{
+		switch (error)
+		{
+		case codec_error::none: return "no error";
+		case codec_error::output_too_small: return "output buffer too small";
+		case codec_error::truncated: return "unexpected end of input";
+		case codec_error::invalid_reference: return "back-reference before the start of the output";
+		case codec_error::invalid_run: return "run exceeds the buffers";
+		case codec_error::invalid_argument: return "invalid argument";
+		}
+		return "unknown error";
+	}
+};
\ No newline at end of file
@@ -0,0 +1,275 @@
+#pragma once
+#include <span>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <optional>
+#include <algorithm>
+#include <filesystem>
+#include <system_error>
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+
+// On-disk cache of compressed payloads, shared by all threads and betterfpk processes on a machine.
+// Blobs are addressed by a hash of the uncompressed content plus the encoder settings.
+// They are written to a temporary file and renamed into place, so readers never see half a blob.
+// The modification time serves as the LRU stamp: hits touch the blob and the oldest blobs are
+// removed once the directory grows beyond its size limit.
+// The cache is only an optimization, every I/O problem is treated as a miss.
+class CompressionCache
+{
+public:
+	struct Key
+	{
+		uint64_t hash;
+		uint64_t size;
+	};
+
+private:
+	struct BlobHeader
+	{
+		uint32_t magic; // "BFC1"
+		uint32_t reserved;
+		uint64_t input_size;
+		uint64_t input_hash;
+		uint64_t payload_size;
+	};
+
+	static constexpr uint32_t MAGIC = '1CFB';
+	static constexpr const char* BLOB_EXTENSION = ".blob";
+
+	std::filesystem::path _dir;
+	const uint64_t _max_size;
+	std::string _params; // part of the blob name, different settings never share blobs
+	std::string _tmp_prefix;
+
+	std::mutex _size_mutex;
+	uint64_t _size = 0; // estimate, other processes write to the directory too
+
+	std::atomic<size_t> _hits = 0;
+	std::atomic<size_t> _misses = 0;
+	std::atomic<size_t> _tmp_counter = 0;
+
+	static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+	static uint64_t read64(const uint8_t* p)
+	{
+		uint64_t v;
+		std::memcpy(&v, p, sizeof(v));
+		return v;
+	}
+
+	static uint32_t read32(const uint8_t* p)
+	{
+		uint32_t v;
+		std::memcpy(&v, p, sizeof(v));
+		return v;
+	}
+
+	std::filesystem::path blob_path(const Key& key) const
+	{
+		char name[64];
+		std::snprintf(name, sizeof(name), "%016llx-%llx-", (unsigned long long)key.hash, (unsigned long long)key.size);
+		return _dir / (name + _params + BLOB_EXTENSION);
+	}
+
+	// Rescans the directory and removes the least recently used blobs until it is below 90% of the limit.
+	void evict()
+	{
+		struct Blob
+		{
+			std::filesystem::file_time_type time;
+			uint64_t size;
+			std::filesystem::path path;
+		};
+
+		std::error_code ec;
+		std::vector<Blob> blobs;
+		uint64_t total = 0;
+		const auto now = std::filesystem::file_time_type::clock::now();
+		for (auto it = std::filesystem::directory_iterator(_dir, ec); !ec && it != std::filesystem::directory_iterator(); it.increment(ec))
+		{
+			std::error_code entry_ec;
+			uint64_t size = it->file_size(entry_ec);
+			auto time = it->last_write_time(entry_ec);
+			if (entry_ec)
+				continue;
+			if (it->path().filename().string().starts_with(".tmp-"))
+			{
+				// left behind by a process that was killed while writing
+				if (now - time > std::chrono::hours(24))
+					std::filesystem::remove(it->path(), entry_ec);
+				continue;
+			}
+			if (it->path().extension() != BLOB_EXTENSION)
+				continue;
+			blobs.push_back({ time, size, it->path() });
+			total += size;
+		}
+
+		if (total > _max_size)
+		{
+			std::sort(blobs.begin(), blobs.end(), [](const Blob& a, const Blob& b) { return a.time < b.time; });
+			const uint64_t target = _max_size / 10 * 9;
+			for (auto& blob : blobs)
+			{
+				if (total <= target)
+					break;
+				// another process may have removed or replaced it already
+				if (std::filesystem::remove(blob.path, ec))
+					total -= blob.size;
+			}
+		}
+		_size = total;
+	}
+
+public:
+	CompressionCache(const std::filesystem::path& dir, uint64_t max_size, std::string params) :
+		_dir(dir),
+		_max_size(max_size),
+		_params(std::move(params))
+	{
+		std::filesystem::create_directories(_dir);
+
+		std::random_device rd;
+		char prefix[32];
+		std::snprintf(prefix, sizeof(prefix), ".tmp-%08x%08x-", rd(), rd());
+		_tmp_prefix = prefix;
+
+		std::lock_guard lock(_size_mutex);
+		evict();
+	}
+
+	CompressionCache(const CompressionCache&) = delete;
+	CompressionCache& operator=(const CompressionCache&) = delete;
+
+	// XXH64 with seed 0
+	static uint64_t hash(std::span<const uint8_t> data)
+	{
+		constexpr uint64_t P1 = 0x9E3779B185EBCA87ull;
+		constexpr uint64_t P2 = 0xC2B2AE3D27D4EB4Full;
+		constexpr uint64_t P3 = 0x165667B19E3779F9ull;
+		constexpr uint64_t P4 = 0x85EBCA77C2B2AE63ull;
+		constexpr uint64_t P5 = 0x27D4EB2F165667C5ull;
+
+		auto round = [](uint64_t acc, uint64_t input) {
+			acc += input * P2;
+			return rotl(acc, 31) * P1;
+		};
+		auto merge = [&](uint64_t acc, uint64_t v) {
+			acc ^= round(0, v);
+			return acc * P1 + P4;
+		};
+
+		const uint8_t* p = data.data();
+		const uint8_t* end = p + data.size();
+		uint64_t h;
+		if (data.size() >= 32)
+		{
+			uint64_t v1 = P1 + P2, v2 = P2, v3 = 0, v4 = 0 - P1;
+			do
+			{
+				v1 = round(v1, read64(p));
+				v2 = round(v2, read64(p + 8));
+				v3 = round(v3, read64(p + 16));
+				v4 = round(v4, read64(p + 24));
+				p += 32;
+			} while (end - p >= 32);
+			h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+			h = merge(h, v1);
+			h = merge(h, v2);
+			h = merge(h, v3);
+			h = merge(h, v4);
+		}
+		else h = P5;
+
+		h += data.size();
+		for (; end - p >= 8; p += 8)
+			h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+		if (end - p >= 4)
+		{
+			h = rotl(h ^ (read32(p) * P1), 23) * P2 + P3;
+			p += 4;
+		}
+		for (; p < end; p++)
+			h = rotl(h ^ (*p * P5), 11) * P1;
+
+		h ^= h >> 33;
+		h *= P2;
+		h ^= h >> 29;
+		h *= P3;
+		h ^= h >> 32;
+		return h;
+	}
+
+	static Key key(std::span<const uint8_t> data)
+	{
+		return { hash(data), data.size() };
+	}
+
+	std::optional<std::vector<uint8_t>> get(const Key& key)
+	{
+		auto path = blob_path(key);
+		std::ifstream fin(path, std::ios::binary);
+		BlobHeader hdr;
+		if (fin.read((char*)&hdr, sizeof(hdr))
+			&& hdr.magic == MAGIC && hdr.input_size == key.size && hdr.input_hash == key.hash
+			&& hdr.payload_size <= key.size * 3 + 1024) // sanity limit before allocating, nothing compresses that badly
+		{
+			std::vector<uint8_t> payload(hdr.payload_size);
+			// the blob has to end exactly after the payload
+			if (fin.read((char*)payload.data(), payload.size()) && fin.peek() == std::ifstream::traits_type::eof())
+			{
+				std::error_code ec;
+				std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ec);
+				_hits++;
+				return payload;
+			}
+		}
+		_misses++;
+		return std::nullopt;
+	}
+
+	void put(const Key& key, std::span<const uint8_t> payload)
+	{
+		auto path = blob_path(key);
+		auto tmp = _dir / (_tmp_prefix + std::to_string(_tmp_counter++));
+
+		BlobHeader hdr{ MAGIC, 0, key.size, key.hash, payload.size() };
+		{
+			std::ofstream fout(tmp, std::ios::binary);
+			fout.write((const char*)&hdr, sizeof(hdr));
+			fout.write((const char*)payload.data(), payload.size());
+			if (!fout.flush())
+			{
+				fout.close();
+				std::error_code ec;
+				std::filesystem::remove(tmp, ec);
+				return;
+			}
+		}
+
+		// atomic replace, concurrent writers of the same key produce the same blob anyway
+		std::error_code ec;
+		std::filesystem::rename(tmp, path, ec);
+		if (ec)
+		{
+			std::filesystem::remove(tmp, ec);
+			return;
+		}
+
+		std::lock_guard lock(_size_mutex);
+		_size += sizeof(hdr) + payload.size();
+		if (_size > _max_size)
+			evict();
+	}
+
+	size_t hits() const { return _hits; }
+	size_t misses() const { return _misses; }
+};
\ No newline at end of file
@@ -0,0 +1,563 @@
+#pragma once
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <optional>
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include <functional>
+#include <filesystem>
+#include <system_error>
+#include <unordered_map>
+#include <condition_variable>
+
+#include <cstdint>
+#include <cstring>
+
+#include "ThreadPool.hpp"
+#include "BufferPool.hpp"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define BETTERFPK_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+// Reads the input files of the packer with many requests in flight and hands them out in their original order.
+// On Linux the size lookups (statx) and reads go through io_uring, everywhere else, or if io_uring is not
+// available, through a pool of reader threads.
+class FileLoader
+{
+public:
+	struct File
+	{
+		size_t index; // in the path list
+		uint64_t size; // the size that was passed to admit
+		std::vector<uint8_t> data;
+		bool streamed = false; // not read, data is empty
+	};
+
+	// Called before a read is started. wait = false: return false if the memory is not available right now.
+	// wait = true: nothing else is in flight, block until the memory is available. false means stop loading.
+	typedef std::function<bool(uint64_t size, bool wait)> admit_t;
+	typedef std::function<void(File&&)> deliver_t;
+	// Returns true for files that are too large to be loaded, the consumer reads them piece by piece.
+	typedef std::function<bool(uint64_t size)> stream_t;
+
+	static constexpr size_t DEFAULT_DEPTH = 64;
+
+private:
+	enum class Op : uint8_t { stat, open, read };
+
+	struct Completion
+	{
+		size_t index;
+		Op op;
+		int64_t result; // size or bytes read, negative on errors
+	};
+
+	class Engine
+	{
+	public:
+		virtual ~Engine() = default;
+		virtual const char* name() const = 0;
+		virtual void stat(size_t index) = 0;
+		virtual void read(size_t index, uint8_t* buffer, size_t size) = 0;
+		// Blocks until one of the requests has finished, there has to be one in flight.
+		virtual Completion wait() = 0;
+	};
+
+	class ThreadEngine : public Engine
+	{
+	private:
+		const std::vector<std::filesystem::path>& _paths;
+		std::mutex _mutex;
+		std::condition_variable _cv;
+		std::deque<Completion> _done;
+		ThreadPool _pool; // last member, so it is joined before the rest goes away
+
+		void complete(const Completion& c)
+		{
+			{
+				std::lock_guard lock(_mutex);
+				_done.push_back(c);
+			}
+			_cv.notify_one();
+		}
+
+	public:
+		ThreadEngine(const std::vector<std::filesystem::path>& paths, int threads) :
+			_paths(paths),
+			_pool(threads)
+		{
+		}
+
+		~ThreadEngine()
+		{
+			_pool.shutdown();
+		}
+
+		const char* name() const override { return "threads"; }
+
+		void stat(size_t index) override
+		{
+			_pool.submit([this, index]() {
+				std::error_code ec;
+				uint64_t size = std::filesystem::file_size(_paths[index], ec);
+				complete({ index, Op::stat, ec ? -1 : (int64_t)size });
+			});
+		}
+
+		void read(size_t index, uint8_t* buffer, size_t size) override
+		{
+			_pool.submit([this, index, buffer, size]() {
+				std::ifstream fin(_paths[index], std::ios::binary);
+				if (!fin.is_open())
+				{
+					complete({ index, Op::read, -1 });
+					return;
+				}
+				fin.read((char*)buffer, size);
+				complete({ index, Op::read, fin.bad() ? -1 : (int64_t)fin.gcount() });
+			});
+		}
+
+		Completion wait() override
+		{
+			std::unique_lock lock(_mutex);
+			_cv.wait(lock, [this]() { return !_done.empty(); });
+			Completion c = _done.front();
+			_done.pop_front();
+			return c;
+		}
+	};
+
+#ifdef BETTERFPK_IO_URING
+	// Talks to the kernel directly, liburing is not needed for the handful of operations used here.
+	class UringEngine : public Engine
+	{
+	private:
+		struct ReadState
+		{
+			int fd = -1;
+			uint8_t* buffer;
+			size_t size;
+			size_t done = 0;
+		};
+
+		static constexpr size_t MAX_READ = (size_t)1 << 30; // sqe.len is 32 bits
+
+		const std::vector<std::filesystem::path>& _paths;
+		int _ring = -1;
+		void* _sq_ptr = MAP_FAILED;
+		size_t _sq_size = 0;
+		void* _cq_ptr = MAP_FAILED;
+		size_t _cq_size = 0;
+		io_uring_sqe* _sqes = (io_uring_sqe*)MAP_FAILED;
+		size_t _sqes_size = 0;
+
+		unsigned* _sq_tail;
+		unsigned* _sq_mask;
+		unsigned* _sq_array;
+		unsigned* _cq_head;
+		unsigned* _cq_tail;
+		unsigned* _cq_mask;
+		io_uring_cqe* _cqes;
+
+		unsigned _to_submit = 0;
+		size_t _in_flight = 0;
+		bool _draining = false;
+
+		// node based, the kernel writes into the elements
+		std::unordered_map<size_t, struct statx> _stats;
+		std::unordered_map<size_t, ReadState> _reads;
+
+		void close_ring()
+		{
+			if (_sqes != MAP_FAILED)
+				munmap(_sqes, _sqes_size);
+			if (_cq_ptr != MAP_FAILED && _cq_ptr != _sq_ptr)
+				munmap(_cq_ptr, _cq_size);
+			if (_sq_ptr != MAP_FAILED)
+				munmap(_sq_ptr, _sq_size);
+			if (_ring >= 0)
+				::close(_ring);
+			_ring = -1;
+		}
+
+		[[noreturn]] void fail(const char* what)
+		{
+			int err = errno;
+			close_ring();
+			throw std::system_error(err, std::generic_category(), what);
+		}
+
+		static void* map(int fd, size_t size, off_t offset)
+		{
+			return mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+		}
+
+		void push(const io_uring_sqe& sqe)
+		{
+			unsigned tail = *_sq_tail; // only written by us
+			unsigned slot = tail & *_sq_mask;
+			_sqes[slot] = sqe;
+			_sq_array[slot] = slot;
+			__atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+			_to_submit++;
+			_in_flight++;
+		}
+
+		static uint64_t user_data(size_t index, Op op)
+		{
+			return ((uint64_t)index << 2) | (uint64_t)op;
+		}
+
+		void push_read(size_t index, ReadState& state)
+		{
+			io_uring_sqe sqe{};
+			sqe.opcode = IORING_OP_READ;
+			sqe.fd = state.fd;
+			sqe.addr = (uint64_t)(state.buffer + state.done);
+			sqe.len = (uint32_t)std::min(state.size - state.done, MAX_READ);
+			sqe.off = state.done;
+			sqe.user_data = user_data(index, Op::read);
+			push(sqe);
+		}
+
+		void enter(unsigned min_complete)
+		{
+			int r = (int)syscall(__NR_io_uring_enter, _ring, _to_submit, min_complete,
+				min_complete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+			if (r < 0)
+			{
+				if (errno == EINTR)
+					return;
+				throw std::system_error(errno, std::generic_category(), "io_uring_enter");
+			}
+			_to_submit -= r;
+		}
+
+		// Advances the state of a request, returns the completion once it is finished.
+		std::optional<Completion> handle(const io_uring_cqe& cqe)
+		{
+			const size_t index = cqe.user_data >> 2;
+			const Op op = (Op)(cqe.user_data & 3);
+			if (op == Op::stat)
+			{
+				auto it = _stats.find(index);
+				int64_t result = cqe.res < 0 ? cqe.res : (int64_t)it->second.stx_size;
+				_stats.erase(it);
+				return Completion{ index, Op::stat, result };
+			}
+
+			auto it = _reads.find(index);
+			ReadState& state = it->second;
+			int64_t result = cqe.res;
+			if (op == Op::open && cqe.res >= 0)
+			{
+				state.fd = cqe.res;
+				if (!_draining)
+				{
+					push_read(index, state);
+					return std::nullopt;
+				}
+			}
+			else if (op == Op::read && cqe.res >= 0)
+			{
+				state.done += cqe.res;
+				if (cqe.res > 0 && state.done < state.size && !_draining)
+				{
+					push_read(index, state);
+					return std::nullopt;
+				}
+				result = state.done;
+			}
+			if (state.fd >= 0)
+				::close(state.fd);
+			_reads.erase(it);
+			return Completion{ index, Op::read, result };
+		}
+
+	public:
+		// Throws if io_uring or one of the needed operations is not available.
+		UringEngine(const std::vector<std::filesystem::path>& paths, unsigned entries) :
+			_paths(paths)
+		{
+			io_uring_params p{};
+			_ring = (int)syscall(__NR_io_uring_setup, entries, &p);
+			if (_ring < 0)
+				fail("io_uring_setup");
+
+			_sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+			_cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+			if (p.features & IORING_FEAT_SINGLE_MMAP)
+				_sq_size = _cq_size = std::max(_sq_size, _cq_size);
+			_sq_ptr = map(_ring, _sq_size, IORING_OFF_SQ_RING);
+			if (_sq_ptr == MAP_FAILED)
+				fail("mmap");
+			_cq_ptr = p.features & IORING_FEAT_SINGLE_MMAP ? _sq_ptr : map(_ring, _cq_size, IORING_OFF_CQ_RING);
+			if (_cq_ptr == MAP_FAILED)
+				fail("mmap");
+			_sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+			_sqes = (io_uring_sqe*)map(_ring, _sqes_size, IORING_OFF_SQES);
+			if (_sqes == MAP_FAILED)
+				fail("mmap");
+
+			uint8_t* sq = (uint8_t*)_sq_ptr;
+			_sq_tail = (unsigned*)(sq + p.sq_off.tail);
+			_sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+			_sq_array = (unsigned*)(sq + p.sq_off.array);
+			uint8_t* cq = (uint8_t*)_cq_ptr;
+			_cq_head = (unsigned*)(cq + p.cq_off.head);
+			_cq_tail = (unsigned*)(cq + p.cq_off.tail);
+			_cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+			_cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+
+			// statx and openat need 5.6, older kernels use the thread engine
+			std::vector<uint8_t> probe_buffer(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+			auto probe = (io_uring_probe*)probe_buffer.data();
+			if (syscall(__NR_io_uring_register, _ring, IORING_REGISTER_PROBE, probe, 256) < 0)
+				fail("io_uring_register");
+			for (int op : { IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ })
+			{
+				if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+				{
+					errno = EOPNOTSUPP;
+					fail("io_uring probe");
+				}
+			}
+		}
+
+		~UringEngine()
+		{
+			// the kernel may still write into the buffers, wait for everything
+			_draining = true;
+			try
+			{
+				while (_in_flight)
+					wait();
+			}
+			catch (...)
+			{
+			}
+			for (auto& [index, state] : _reads)
+			{
+				if (state.fd >= 0)
+					::close(state.fd);
+			}
+			close_ring();
+		}
+
+		const char* name() const override { return "io_uring"; }
+
+		void stat(size_t index) override
+		{
+			struct statx& buffer = _stats[index];
+			io_uring_sqe sqe{};
+			sqe.opcode = IORING_OP_STATX;
+			sqe.fd = AT_FDCWD;
+			sqe.addr = (uint64_t)_paths[index].c_str();
+			sqe.len = STATX_SIZE;
+			sqe.off = (uint64_t)&buffer;
+			sqe.user_data = user_data(index, Op::stat);
+			push(sqe);
+		}
+
+		void read(size_t index, uint8_t* buffer, size_t size) override
+		{
+			ReadState& state = _reads[index];
+			state.buffer = buffer;
+			state.size = size;
+			io_uring_sqe sqe{};
+			sqe.opcode = IORING_OP_OPENAT;
+			sqe.fd = AT_FDCWD;
+			sqe.addr = (uint64_t)_paths[index].c_str();
+			sqe.open_flags = O_RDONLY | O_CLOEXEC;
+			sqe.user_data = user_data(index, Op::open);
+			push(sqe);
+		}
+
+		Completion wait() override
+		{
+			if (!_in_flight)
+				throw std::logic_error("No io_uring request in flight");
+			while (true)
+			{
+				unsigned head = *_cq_head;
+				if (head != __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE))
+				{
+					io_uring_cqe cqe = _cqes[head & *_cq_mask];
+					__atomic_store_n(_cq_head, head + 1, __ATOMIC_RELEASE);
+					_in_flight--;
+					if (auto c = handle(cqe))
+						return *c;
+					continue;
+				}
+				enter(1);
+			}
+		}
+	};
+#endif
+
+	const std::vector<std::filesystem::path>& _paths;
+	BufferPool& _buffers;
+	const size_t _depth;
+
+	const char* _engine_name = "";
+	size_t _files = 0;
+	uint64_t _bytes = 0;
+	double _seconds = 0;
+	double _stalled = 0; // waiting for memory or for the queue
+
+	std::unique_ptr<Engine> make_engine()
+	{
+#ifdef BETTERFPK_IO_URING
+		try
+		{
+			// two requests per file at most: the size lookup ahead and the read
+			return std::make_unique<UringEngine>(_paths, (unsigned)(2 * _depth));
+		}
+		catch (const std::exception&)
+		{
+			// no io_uring (old kernel, seccomp, ...)
+		}
+#endif
+		return std::make_unique<ThreadEngine>(_paths, (int)std::min<size_t>(_depth, 16));
+	}
+
+public:
+	FileLoader(const std::vector<std::filesystem::path>& paths, BufferPool& buffers, size_t depth = DEFAULT_DEPTH) :
+		_paths(paths),
+		_buffers(buffers),
+		_depth(std::max<size_t>(depth, 1))
+	{
+	}
+
+	// Loads all files and passes them to deliver in order. Stops early if admit returns false.
+	// Files stream selects are delivered without being read or admitted.
+	void run(const admit_t& admit, const deliver_t& deliver, const stream_t& stream = nullptr)
+	{
+		struct Slot
+		{
+			int64_t size = -1;
+			int64_t result = -1;
+			bool stat_done = false;
+			bool read_done = false;
+			bool streamed = false;
+			std::vector<uint8_t> data;
+		};
+
+		typedef std::chrono::steady_clock clock;
+		auto stall = [this](auto&& f) {
+			const auto t = clock::now();
+			auto result = f();
+			_stalled += std::chrono::duration<double>(clock::now() - t).count();
+			return result;
+		};
+
+		const auto start = clock::now();
+		const size_t n = _paths.size();
+		std::vector<Slot> slots(n);
+		auto engine = make_engine(); // declared after the slots, so it finishes the reads into them before they go away
+		_engine_name = engine->name();
+
+		size_t next_stat = 0, next_read = 0, next_out = 0;
+		size_t stats_in_flight = 0, reads_in_flight = 0;
+		while (next_out < n)
+		{
+			// look up the sizes a bit ahead of the reads
+			while (next_stat < n && stats_in_flight < _depth && next_stat < next_out + 4 * _depth)
+			{
+				engine->stat(next_stat++);
+				stats_in_flight++;
+			}
+
+			// start the reads in order, once the size is known and the memory is available
+			while (next_read < n && reads_in_flight < _depth && slots[next_read].stat_done)
+			{
+				Slot& slot = slots[next_read];
+				if (slot.size < 0) // reported when it is delivered
+				{
+					slot.read_done = true;
+					next_read++;
+					continue;
+				}
+				if (stream && stream(slot.size))
+				{
+					slot.streamed = slot.read_done = true;
+					next_read++;
+					continue;
+				}
+				const bool idle = reads_in_flight == 0 && next_out == next_read;
+				if (!stall([&]() { return admit(slot.size, idle); }))
+				{
+					if (idle)
+						return;
+					break;
+				}
+				slot.data = _buffers.take(slot.size);
+				engine->read(next_read, slot.data.data(), slot.data.size());
+				reads_in_flight++;
+				next_read++;
+			}
+
+			while (next_out < next_read && slots[next_out].read_done)
+			{
+				Slot& slot = slots[next_out];
+				if (slot.streamed)
+				{
+					deliver(File{ next_out, (uint64_t)slot.size, {}, true });
+					next_out++;
+					continue;
+				}
+				if (slot.size < 0 || slot.result < 0)
+					throw std::runtime_error("Unable to read " + _paths[next_out].string());
+				if ((uint64_t)slot.result < slot.data.size()) // the file shrank in the meantime
+					slot.data.resize(slot.result);
+				_files++;
+				_bytes += slot.data.size();
+				stall([&]() {
+					deliver(File{ next_out, (uint64_t)slot.size, std::move(slot.data) });
+					return true;
+				});
+				next_out++;
+			}
+
+			if (next_out == n || stats_in_flight + reads_in_flight == 0)
+				continue;
+			Completion c = engine->wait();
+			Slot& slot = slots[c.index];
+			if (c.op == Op::stat)
+			{
+				stats_in_flight--;
+				slot.stat_done = true;
+				slot.size = c.result;
+			}
+			else
+			{
+				reads_in_flight--;
+				slot.read_done = true;
+				slot.result = c.result;
+			}
+		}
+		_seconds = std::chrono::duration<double>(clock::now() - start).count();
+	}
+
+	const char* engine_name() const { return _engine_name; }
+	size_t files() const { return _files; }
+	uint64_t bytes() const { return _bytes; }
+	double seconds() const { return _seconds; }
+	// time spent reading, without the waits for the compressor
+	double read_seconds() const { return std::max(_seconds - _stalled, 0.0); }
+};
\ No newline at end of file
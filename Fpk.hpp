@@ -0,0 +1,76 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstring>
+#include <cctype>
+
+#include <cstdint>
+
+struct FpkTRL
+{
+	uint32_t key, toc_offset;
+};
+
+template <size_t S>
+struct FpkEntry1
+{
+	uint32_t offset, length;
+	char filename[S];
+	uint32_t hash;
+
+	FpkEntry1() = default;
+
+	FpkEntry1(uint32_t offs, uint32_t len, const std::string& fn, uint32_t hash) :
+		offset(offs), length(len), hash(hash)
+	{
+		std::memset(filename, 0, sizeof(filename));
+		std::strncpy(filename, fn.c_str(), sizeof(filename) - 1);
+	}
+};
+
+typedef FpkEntry1<24> FpkV2Entry;
+typedef FpkEntry1<128> FpkV3Entry;
+typedef FpkEntry1<260> FpkV4Entry;
+
+struct FpkEntry2
+{
+	uint32_t offset, length;
+	char filename[24];
+};
+
+struct FpkHeader
+{
+	uint32_t entry_count;
+	bool obfuscated;
+
+	FpkHeader() = default;
+
+	FpkHeader(uint32_t fpk_header) :
+		entry_count(fpk_header & 0x0FFFFFFF),
+		obfuscated((fpk_header & 0x80000000) != 0)
+	{
+	}
+};
+
+// case insensitive name hash, the packer sorts the TOC by it
+inline uint32_t hash(std::string_view s)
+{
+	char c;
+	uint16_t res = 0;
+	for (int i = 0; i < s.length();)
+	{
+		c = (char)::toupper((unsigned char)s[i++]);
+		res += c * i;
+	}
+	return res;
+}
+
+template<typename T>
+void obfuscate(std::vector<T>& data, uint32_t key)
+{
+	uint32_t* pos = (uint32_t*)data.data();
+	uint32_t* end = (uint32_t*)((size_t)pos + data.size() * sizeof(T));
+	while (pos < end)
+		*pos++ ^= key;
+}
\ No newline at end of file
@@ -0,0 +1,452 @@
+#pragma once
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <optional>
+#include <algorithm>
+#include <stdexcept>
+#include <filesystem>
+
+#include <cstdint>
+
+#include "Fpk.hpp"
+#include "MappedFile.hpp"
+#include "RLE.hpp"
+#include "ZLC.hpp"
+
+struct PayloadInfo
+{
+	size_t original_size;
+	const char* compression;
+};
+
+// Only looks at the payload headers, the data itself is never touched.
+inline PayloadInfo peek_payload(std::span<const uint8_t> payload)
+{
+	if (rle::is_compressed(payload))
+	{
+		// the encoder keeps the ZLC2 header in the first literal run
+		auto inner = rle::leading_literals(payload);
+		if (zlc::is_compressed(inner))
+			return { zlc::decoded_size(inner), "rle+zlc" };
+		return { rle::decoded_size(payload), "rle" };
+	}
+	if (zlc::is_compressed(payload))
+		return { zlc::decoded_size(payload), "zlc" };
+	return { payload.size(), "none" };
+}
+
+// Opens an archive once and gives random access to its entries.
+// The TOC is kept in a flat array sorted by the name hash, so lookups are a binary search.
+class FpkReader
+{
+public:
+	struct Entry
+	{
+		uint32_t offset, length;
+		uint32_t hash;
+		std::string name;
+	};
+
+	// Payloads that are read one after another are requested this far ahead of the reader.
+	static constexpr size_t READAHEAD_WINDOW = 32 << 20;
+	// Neighbouring payloads are requested together if no more than this lies between them.
+	static constexpr size_t READAHEAD_GAP = 64 << 10;
+
+private:
+	static constexpr size_t STREAM_BUFFER_SIZE = 1 << 20;
+
+	MappedFile _file;
+	FpkHeader _header;
+	FpkTRL _trl{};
+	std::vector<Entry> _entries;
+
+	template <typename T>
+	void load_toc()
+	{
+		// obfuscated archives keep the TOC at the offset stored in the trailer, the others right after the header
+		size_t toc_offset = sizeof(uint32_t);
+		if (_header.obfuscated)
+		{
+			if (_file.size() < sizeof(FpkTRL))
+				throw std::runtime_error("The archive is too small to contain a trailer");
+			std::memcpy(&_trl, _file.data() + _file.size() - sizeof(FpkTRL), sizeof(FpkTRL));
+			toc_offset = _trl.toc_offset;
+		}
+
+		auto data = _file.span(toc_offset, (size_t)_header.entry_count * sizeof(T));
+		std::vector<T> toc(_header.entry_count);
+		std::memcpy(toc.data(), data.data(), data.size());
+		if (_header.obfuscated)
+			obfuscate(toc, _trl.key);
+
+		_entries.reserve(toc.size());
+		for (auto& entry : toc)
+		{
+			std::string name(entry.filename, strnlen(entry.filename, sizeof(entry.filename)));
+			uint32_t h = hash(name);
+			_entries.push_back({ entry.offset, entry.length, h, std::move(name) });
+		}
+		std::stable_sort(_entries.begin(), _entries.end(), [](const Entry& a, const Entry& b) { return a.hash < b.hash; });
+	}
+
+	static bool iequals(std::string_view a, std::string_view b)
+	{
+		return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](unsigned char x, unsigned char y) {
+			return ::toupper(x) == ::toupper(y);
+		});
+	}
+
+public:
+	FpkReader(const std::filesystem::path& path, int version) :
+		_file(path)
+	{
+		uint32_t fpk_header;
+		std::memcpy(&fpk_header, _file.span(0, sizeof(fpk_header)).data(), sizeof(fpk_header));
+		_header = FpkHeader(fpk_header);
+
+		if (!_header.obfuscated)
+			load_toc<FpkEntry2>();
+		else if (version <= 2)
+			load_toc<FpkV2Entry>();
+		else if (version == 3)
+			load_toc<FpkV3Entry>();
+		else if (version == 4)
+			load_toc<FpkV4Entry>();
+		else
+			throw std::runtime_error("Unsupported FPK version: " + std::to_string(version));
+	}
+
+	const MappedFile& file() const { return _file; }
+	const FpkHeader& header() const { return _header; }
+	const FpkTRL& trailer() const { return _trl; }
+	const std::vector<Entry>& entries() const { return _entries; }
+
+	// The entries in payload order. Reading them in TOC (hash) order jumps all over the archive,
+	// this order is one pass from the front to the back.
+	std::vector<const Entry*> read_order() const
+	{
+		std::vector<const Entry*> order;
+		order.reserve(_entries.size());
+		for (auto& entry : _entries)
+			order.push_back(&entry);
+		std::sort(order.begin(), order.end(), [](auto a, auto b) { return a->offset < b->offset; });
+		return order;
+	}
+
+	// Reads ahead of a walk through entries sorted by offset. The payloads in the READAHEAD_WINDOW
+	// after the current one are requested, neighbours merged into one request per range.
+	class Readahead
+	{
+	private:
+		const FpkReader& _reader;
+		const std::vector<const Entry*>& _order;
+		size_t _next = 0; // first entry that was not requested yet
+
+	public:
+		Readahead(const FpkReader& reader, const std::vector<const Entry*>& order) :
+			_reader(reader),
+			_order(order)
+		{
+		}
+
+		// Call before the entry at index is read.
+		void advance(size_t index)
+		{
+			_next = std::max(_next, index);
+			const uint64_t limit = (uint64_t)_order[index]->offset + READAHEAD_WINDOW;
+			while (_next < _order.size() && _order[_next]->offset < limit)
+			{
+				const uint64_t begin = _order[_next]->offset;
+				uint64_t end = begin + _order[_next]->length;
+				for (_next++; _next < _order.size() && _order[_next]->offset <= end + READAHEAD_GAP && _order[_next]->offset < limit; _next++)
+					end = std::max(end, (uint64_t)_order[_next]->offset + _order[_next]->length);
+
+				// larger entries only get their start, the rest is read ahead as they are decoded
+				end = std::min({ end, begin + READAHEAD_WINDOW, (uint64_t)_reader._file.size() });
+				if (begin < end)
+					_reader._file.prefetch({ _reader._file.data() + begin, (size_t)(end - begin) });
+			}
+		}
+	};
+
+	const Entry* find(std::string_view name) const
+	{
+		const uint32_t h = hash(name);
+		auto it = std::lower_bound(_entries.begin(), _entries.end(), h, [](const Entry& e, uint32_t h) { return e.hash < h; });
+		for (; it != _entries.end() && it->hash == h; ++it)
+		{
+			if (iequals(it->name, name))
+				return &*it;
+		}
+		return nullptr;
+	}
+
+	std::span<const uint8_t> payload(const Entry& entry) const
+	{
+		return _file.span(entry.offset, entry.length);
+	}
+
+	// Decodes an entry. Stored entries are returned as a view into the mapping,
+	// decoded ones live in buffer. scratch takes the RLE0 layer of entries with both layers.
+	// Both keep their capacity, so reusing them for the next entry avoids allocations.
+	std::span<const uint8_t> read_entry(const Entry& entry, std::vector<uint8_t>& buffer, std::vector<uint8_t>& scratch) const
+	{
+		auto data = payload(entry);
+		if (rle::is_compressed(data))
+		{
+			rle::decompress(data, scratch);
+			data = scratch;
+		}
+		if (zlc::is_compressed(data))
+		{
+			zlc::decompress(data, buffer);
+			return buffer;
+		}
+		if (data.data() == scratch.data())
+		{
+			std::swap(buffer, scratch);
+			return buffer;
+		}
+		return data;
+	}
+
+	// Decodes an entry piece by piece and hands the pieces to write(std::span<const uint8_t>).
+	// Needs two buffers of STREAM_BUFFER_SIZE and the decoders, no matter how large the entry is.
+	// The pages of the payload are released from the mapping once they are decoded.
+	// Writes the same bytes as read_entry.
+	template <typename F>
+	void stream_entry(const Entry& entry, F&& write) const
+	{
+		std::span<const uint8_t> data = payload(entry);
+		const uint8_t* released = data.data();
+		auto release = [&](size_t min_size) {
+			if ((size_t)(data.data() - released) >= min_size)
+			{
+				_file.release({ released, data.data() });
+				released = data.data();
+			}
+		};
+		// keeps READAHEAD_WINDOW bytes ahead of the decoder requested
+		const uint8_t* prefetched = data.data();
+		auto prefetch = [&]() {
+			const uint8_t* end = data.data() + std::min(data.size(), READAHEAD_WINDOW);
+			if ((size_t)(end - prefetched) >= STREAM_BUFFER_SIZE || (end == data.data() + data.size() && end > prefetched))
+			{
+				_file.prefetch({ prefetched, end });
+				prefetched = end;
+			}
+		};
+
+		const bool rle_layer = rle::is_compressed(data);
+		if (!rle_layer && !zlc::is_compressed(data))
+		{
+			// stored
+			while (!data.empty())
+			{
+				prefetch();
+				size_t n = std::min(data.size(), STREAM_BUFFER_SIZE);
+				write(data.first(n));
+				data = data.subspan(n);
+				release(0);
+			}
+			return;
+		}
+
+		std::optional<rle::decoder> rle_stage;
+		std::vector<uint8_t> rle_buffer;
+		std::span<const uint8_t> pending; // decoded RLE0 layer that ZLC did not take yet
+		if (rle_layer)
+		{
+			rle_stage.emplace(data.size());
+			rle_buffer.resize(STREAM_BUFFER_SIZE);
+		}
+		zlc::decoder zlc_stage(rle_layer ? rle::decoded_size(data) : data.size());
+		std::vector<uint8_t> buffer(STREAM_BUFFER_SIZE);
+
+		while (!zlc_stage.done())
+		{
+			prefetch();
+			if (rle_layer && pending.empty())
+			{
+				auto result = rle_stage->decode(data, rle_buffer);
+				if (!result)
+					throw std::runtime_error(std::string("Invalid RLE0 stream: ") + result.message());
+				pending = std::span<const uint8_t>(rle_buffer).first(result.size);
+			}
+
+			auto result = zlc_stage.decode(rle_layer ? pending : data, buffer);
+			if (result.size)
+				write(std::span<const uint8_t>(buffer).first(result.size));
+			if (result.error == codec_error::truncated)
+			{
+				// like zlc::decompress, the missing part is zeroed
+				std::fill(buffer.begin(), buffer.end(), 0);
+				for (uint64_t left = zlc_stage.decoded_size() - zlc_stage.written(); left; )
+				{
+					size_t n = (size_t)std::min<uint64_t>(left, buffer.size());
+					write(std::span<const uint8_t>(buffer).first(n));
+					left -= n;
+				}
+				break;
+			}
+			if (!result)
+				throw std::runtime_error(std::string("Invalid ZLC stream: ") + result.message());
+			release(STREAM_BUFFER_SIZE);
+		}
+		release(0);
+	}
+
+	// What verify_entry found out about an entry, problem is empty if nothing is wrong with it.
+	struct Verdict
+	{
+		uint64_t decoded = 0; // 0 for stored entries, nothing is decoded
+		bool stored = false;
+		std::string problem;
+	};
+
+	// Decodes an entry only to check it: the payload has to lie inside the archive and every
+	// stream has to fill the size in its header, no more and no less. One byte after a ZLC2
+	// stream is fine, encoders that write the flag byte before its tokens leave an empty one.
+	// Entries whose layers need more than max_memory are decoded piece by piece.
+	// buffer and scratch only grow, reusing them for the next entry avoids allocations.
+	Verdict verify_entry(const Entry& entry, size_t max_memory, std::vector<uint8_t>& buffer, std::vector<uint8_t>& scratch) const
+	{
+		Verdict verdict;
+		if ((uint64_t)entry.offset + entry.length > _file.size())
+		{
+			verdict.problem = "payload " + std::to_string(entry.offset) + '+' + std::to_string(entry.length)
+				+ " exceeds the archive size of " + std::to_string(_file.size());
+			return verdict;
+		}
+
+		auto check = [&](const char* layer, codec_error error, uint64_t written, uint64_t expected, size_t trailing, size_t allowed) {
+			if (error == codec_error::truncated)
+				verdict.problem = std::string(layer) + " stream ends after " + std::to_string(written)
+					+ " of " + std::to_string(expected) + " bytes";
+			else if (error != codec_error::none)
+				verdict.problem = std::string("invalid ") + layer + " stream: " + codec_result{ 0, error }.message();
+			else if (trailing > allowed)
+				verdict.problem = std::string(layer) + " stream goes on for " + std::to_string(trailing)
+					+ " bytes after its " + std::to_string(expected) + " bytes";
+			return verdict.problem.empty();
+		};
+		auto grow = [](std::vector<uint8_t>& v, size_t size) {
+			if (v.size() < size)
+				v.resize(size);
+			return std::span<uint8_t>(v).first(size);
+		};
+
+		std::span<const uint8_t> data = payload(entry);
+		const bool rle_layer = rle::is_compressed(data);
+		const auto inner = rle_layer ? rle::leading_literals(data) : data;
+		if (!rle_layer && !zlc::is_compressed(data))
+		{
+			verdict.stored = true;
+			return verdict;
+		}
+
+		const uint64_t rle_size = rle_layer ? rle::decoded_size(data) : 0;
+		if (rle_size + (zlc::is_compressed(inner) ? zlc::decoded_size(inner) : 0) <= max_memory)
+		{
+			if (rle_layer)
+			{
+				auto result = rle::decompress(data, grow(scratch, rle_size));
+				if (!check("RLE0", result.error, result.size, rle_size, data.size() - result.consumed, 0))
+					return verdict;
+				data = std::span<const uint8_t>(scratch).first(result.size);
+				if (!zlc::is_compressed(data))
+				{
+					verdict.decoded = data.size();
+					return verdict;
+				}
+			}
+			const size_t zlc_size = zlc::decoded_size(data);
+			auto result = zlc::decompress(data, grow(buffer, zlc_size));
+			if (check("ZLC2", result.error, result.size, zlc_size, data.size() - result.consumed, 1))
+				verdict.decoded = result.size;
+			return verdict;
+		}
+
+		// like stream_entry, without the output
+		std::optional<rle::decoder> rle_stage;
+		std::span<const uint8_t> pending; // decoded RLE0 layer that ZLC did not take yet
+		if (rle_layer)
+			rle_stage.emplace(data.size());
+		zlc::decoder zlc_stage(rle_layer ? rle_size : data.size());
+		auto rle_buffer = grow(scratch, STREAM_BUFFER_SIZE);
+		auto zlc_buffer = grow(buffer, STREAM_BUFFER_SIZE);
+		while (!zlc_stage.done())
+		{
+			if (rle_layer && pending.empty())
+			{
+				auto result = rle_stage->decode(data, rle_buffer);
+				if (!check("RLE0", result.error, rle_stage->written(), rle_size, 0, 0))
+					return verdict;
+				pending = rle_buffer.first(result.size);
+			}
+			auto result = zlc_stage.decode(rle_layer ? pending : data, zlc_buffer);
+			if (!check("ZLC2", result.error, zlc_stage.written(), zlc_stage.decoded_size(), 0, 0))
+				return verdict;
+		}
+		// what is left of the input, as far as the RLE0 layer got
+		const uint64_t trailing = rle_layer ? pending.size() + rle_size - rle_stage->written() : data.size();
+		if (check("ZLC2", codec_error::none, zlc_stage.written(), zlc_stage.decoded_size(), (size_t)trailing, 1)
+			&& (!rle_layer || !rle_stage->done() || check("RLE0", codec_error::none, rle_size, rle_size, data.size(), 0)))
+			verdict.decoded = zlc_stage.written();
+		return verdict;
+	}
+
+	std::span<const uint8_t> read_entry(const Entry& entry, std::vector<uint8_t>& buffer) const
+	{
+		std::vector<uint8_t> scratch;
+		return read_entry(entry, buffer, scratch);
+	}
+
+	std::vector<uint8_t> read_entry(std::string_view name) const
+	{
+		const Entry* entry = find(name);
+		if (!entry)
+			throw std::out_of_range("Entry not found in the archive: " + std::string(name));
+
+		std::vector<uint8_t> buffer;
+		auto data = read_entry(*entry, buffer);
+		if (data.data() != buffer.data())
+			buffer.assign(data.begin(), data.end());
+		return buffer;
+	}
+
+	// The payload of the entry with the same name and content, if it was packed with the
+	// compressions that are requested now. stored: raw payloads are fine too, they are what the
+	// store policy leaves of incompressible files. Damaged entries are just not reused.
+	std::optional<std::span<const uint8_t>> reusable_payload(std::string_view name, std::span<const uint8_t> data,
+		bool zlc, bool rle, bool stored) const
+	{
+		const Entry* entry = find(name);
+		if (!entry)
+			return std::nullopt;
+
+		auto payload = this->payload(*entry);
+		auto info = peek_payload(payload);
+		std::string_view compression = info.compression;
+		if (info.original_size != data.size()
+			|| (compression.starts_with("rle") && !rle))
+			return std::nullopt;
+		if (compression == "none" ? zlc && !stored : (compression.find("zlc") != std::string_view::npos) != zlc)
+			return std::nullopt;
+
+		try
+		{
+			std::vector<uint8_t> buffer;
+			auto decoded = read_entry(*entry, buffer);
+			if (!std::equal(decoded.begin(), decoded.end(), data.begin(), data.end()))
+				return std::nullopt;
+		}
+		catch (const std::exception& exc)
+		{
+			return std::nullopt;
+		}
+		return payload;
+	}
+};
\ No newline at end of file
@@ -0,0 +1,170 @@
+#pragma once
+#include <span>
+#include <string>
+#include <stdexcept>
+#include <filesystem>
+
+#include <cstdint>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// Read-only memory mapping of a whole file.
+class MappedFile
+{
+private:
+	const uint8_t* _data = nullptr;
+	size_t _size = 0;
+
+#ifdef _WIN32
+	HANDLE _mapping = nullptr;
+#endif
+
+public:
+	MappedFile() = default;
+
+	explicit MappedFile(const std::filesystem::path& path)
+	{
+		open(path);
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile()
+	{
+		close();
+	}
+
+	void open(const std::filesystem::path& path)
+	{
+		close();
+#ifdef _WIN32
+		HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			throw std::runtime_error("Unable to open " + path.string());
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file, &size))
+		{
+			CloseHandle(file);
+			throw std::runtime_error("Unable to get the size of " + path.string());
+		}
+		_size = (size_t)size.QuadPart;
+
+		if (_size) // empty files cannot be mapped
+		{
+			_mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (_mapping)
+				_data = (const uint8_t*)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+		}
+		CloseHandle(file); // the mapping keeps its own reference
+
+		if (_size && !_data)
+		{
+			close();
+			throw std::runtime_error("Unable to map " + path.string());
+		}
+#else
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			throw std::runtime_error("Unable to open " + path.string());
+
+		struct stat st;
+		if (fstat(fd, &st) != 0)
+		{
+			::close(fd);
+			throw std::runtime_error("Unable to get the size of " + path.string());
+		}
+		_size = (size_t)st.st_size;
+
+		if (_size) // empty files cannot be mapped
+		{
+			void* p = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED)
+				_data = (const uint8_t*)p;
+		}
+		::close(fd); // the mapping keeps its own reference
+
+		if (_size && !_data)
+		{
+			_size = 0;
+			throw std::runtime_error("Unable to map " + path.string());
+		}
+#endif
+	}
+
+	void close()
+	{
+#ifdef _WIN32
+		if (_data)
+			UnmapViewOfFile(_data);
+		if (_mapping)
+			CloseHandle(_mapping);
+		_mapping = nullptr;
+#else
+		if (_data)
+			munmap((void*)_data, _size);
+#endif
+		_data = nullptr;
+		_size = 0;
+	}
+
+	const uint8_t* data() const { return _data; }
+	size_t size() const { return _size; }
+
+	// Asks the system to read a range from the disk in the background, so the pages are there
+	// by the time they are touched. Only a hint, errors are ignored.
+	void prefetch(std::span<const uint8_t> range) const
+	{
+		if (range.empty())
+			return;
+#ifdef _WIN32
+		WIN32_MEMORY_RANGE_ENTRY entry{ (void*)range.data(), range.size() };
+		PrefetchVirtualMemory(GetCurrentProcess(), 1, &entry, 0);
+#else
+		// madvise wants a page aligned start
+		const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+		const uintptr_t begin = (uintptr_t)range.data() & ~(page - 1);
+		madvise((void*)begin, (uintptr_t)range.data() + range.size() - begin, MADV_WILLNEED);
+#endif
+	}
+
+	// Drops the pages of a range that was read and is not needed again soon. They are read
+	// from the file again if they are touched later.
+	void release(std::span<const uint8_t> range) const
+	{
+#ifdef _WIN32
+		// unlocking pages that are not locked removes them from the working set
+		VirtualUnlock((void*)range.data(), range.size());
+#else
+		// only the pages that lie completely inside the range
+		const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+		const uintptr_t begin = ((uintptr_t)range.data() + page - 1) & ~(page - 1);
+		const uintptr_t end = ((uintptr_t)range.data() + range.size()) & ~(page - 1);
+		if (begin < end)
+			madvise((void*)begin, end - begin, MADV_DONTNEED);
+#endif
+	}
+
+	std::span<const uint8_t> span(size_t offset, size_t length) const
+	{
+		if (offset > _size || length > _size - offset)
+			throw std::out_of_range("Range " + std::to_string(offset) + '+' + std::to_string(length)
+				+ " exceeds the file size of " + std::to_string(_size));
+		return { _data + offset, length };
+	}
+};
\ No newline at end of file
@@ -1,24 +1,42 @@
 #pragma once
+#include <map>
 #include <deque>
 #include <thread>
 #include <mutex>
-#include <chrono>
+#include <atomic>
+#include <memory>
+#include <span>
+#include <optional>
+#include <limits>
+#include <algorithm>
 #include <functional>
+#include <exception>
+#include <stdexcept>
+#include <condition_variable>
 
 #include "Options.hpp"
 #include "ZLC.hpp"
+#include "RLE.hpp"
+#include "ThreadPool.hpp"
+#include "CompressionCache.hpp"
+#include "BufferPool.hpp"
+#include "StorePolicy.hpp"
 
 template<class Compressor>
 class MultithreadCompressor
 {
 public:
 	enum class Mode { compress, decompress };
+	// completion: results come out as soon as they are done
+	// input: results come out in the order of emplace, for reproducible archives
+	enum class Order { completion, input };
 
 	typedef std::pair<std::string, std::vector<uint8_t>> task_t;
 	typedef std::deque<task_t> queue_t;
 
 	typedef std::function<void(const task_t&)> task_started_callback_t;
 	typedef std::function<void(const task_t&)> task_finished_callback_t;
+	typedef std::function<void(const std::string&, const StorePolicy::Report&)> task_report_callback_t;
 
 private:
 	enum class State
@@ -29,25 +47,59 @@ private:
 	};
 
 	const int _thread_count;
-	State _state = State::idle;
-	
-	queue_t _inputs;
-	queue_t _outputs;
+	State _state = State::idle; // only changed by start/stop_wait on the owning thread
 
-	std::mutex _in_mutex;
+	std::unique_ptr<ThreadPool> _pool;
+
+	struct Output
+	{
+		task_t task;
+		size_t charge; // bytes counted against the memory budget
+	};
+
+	// keyed by the emplace sequence number, guarded by _out_mutex like the counters below
+	std::map<size_t, Output> _outputs;
 	std::mutex _out_mutex;
+	std::condition_variable _out_cv;
+	std::condition_variable _window_cv;
+	Order _order = Order::completion;
+	size_t _next_in = 0;  // sequence number of the next emplaced task
+	size_t _next_out = 0; // sequence number of the next result in input order
+	std::exception_ptr _error; // first failure of a worker, guarded by _out_mutex
 
-	size_t _mem_usage;
+	// memory budget: reserved by the producers before loading, handed back when the result is popped
+	const size_t _mem_limit;
+	size_t _mem_usage = 0; // guarded by _mem_mutex
+	size_t _mem_peak = 0;
+	std::mutex _mem_mutex;
+	std::condition_variable _mem_cv;
 
-	std::vector<std::thread> _threads;
-	std::vector<bool> _threads_busy;
-	bool _should_stop = false;
+	std::atomic<bool> _should_stop = false;
 
 	task_started_callback_t _task_started_callback;
 	task_finished_callback_t _task_finished_callback;
+	task_report_callback_t _task_report_callback;
+	CompressionCache* _cache = nullptr;
+	BufferPool* _buffers = nullptr;
+
+	// scratch memory of a worker thread, reused for all the tasks it runs
+	struct Arena
+	{
+		typename Compressor::workspace zlc;
+		std::vector<uint8_t> rle; // decoded RLE0 layer while the ZLC2 layer is decoded
+	};
+
+	// larger decode buffers are not kept, they would live outside the memory budget
+	static constexpr size_t ARENA_KEEP_SIZE = 4 << 20;
+
+	static Arena& arena()
+	{
+		static thread_local Arena a;
+		return a;
+	}
 
 public:
-	MultithreadCompressor(int threads = 0) :
+	MultithreadCompressor(int threads = 0, size_t memory_limit = std::numeric_limits<size_t>::max()) :
 		_thread_count( // threads ? threads : (std::thread::hardware_concurrency() ? std::thread::hardware_concurrency() : 4))
 			[](int tc) {
 				if (tc == 0)
@@ -58,9 +110,7 @@ public:
 				}
 				return tc;
 			}(threads)),
-		_mem_usage(0),
-		_threads(_thread_count),
-		_threads_busy(_thread_count, false)
+		_mem_limit(memory_limit)
 	{
 	}
 
@@ -68,19 +118,15 @@ public:
 	{
 		try
 		{
-			if (_state != State::idle)
-			{
-				_should_stop = true;
-				for (auto& t : _threads)
-					t.join();
-			}
+			stop();
+			stop_wait();
 		}
 		catch (...)
 		{
 			std::cerr << "Unexpected error during termination of compression threads!\n";
 		}
 	}
-	
+
 
 	void task_started_callack(const task_started_callback_t& callback)
 	{
@@ -92,124 +138,472 @@ public:
 		_task_finished_callback = callback;
 	}
 
+	// Called by the workers with the store decision of every compressed file.
+	void task_report_callback(const task_report_callback_t& callback)
+	{
+		_task_report_callback = callback;
+	}
+
+	// The input buffers the workers are done with go to this pool and decoded
+	// outputs are taken from it. nullptr disables it.
+	void buffers(BufferPool* buffers)
+	{
+		_buffers = buffers;
+	}
+
+	// Compressed payloads are looked up in and added to this cache, nullptr disables it.
+	void cache(CompressionCache* cache)
+	{
+		_cache = cache;
+	}
+
 	void push(const task_t& task)
 	{
-		_in_mutex.lock();
-		_inputs.push_back(task);
-		_in_mutex.unlock();
-		_mem_usage += task.second.size();
+		emplace(task_t(task));
 	}
 
+	// Blocks until the task fits into the memory budget.
 	void emplace(task_t&& task)
 	{
-		_in_mutex.lock();
-		task_t& t = _inputs.emplace_back(task);
-		_in_mutex.unlock();
-		_mem_usage += t.second.size();
+		size_t cost = _state == State::decompressing ? decompress_cost(task.second) : compress_cost(task.second.size());
+		if (!acquire_memory(cost))
+			throw std::runtime_error("The compressor was stopped.");
+		emplace(std::move(task), cost);
+	}
+
+	// Queues a task that was paid for with acquire_memory beforehand.
+	// In input order this also blocks while the task is too far ahead of the consumer.
+	void emplace(task_t&& task, size_t reserved)
+	{
+		size_t seq;
+		if (!next_sequence(seq, reserved))
+			return;
+		auto shared_task = std::make_shared<task_t>(std::move(task));
+		_pool->submit([this, shared_task, seq, reserved]() { process(std::move(*shared_task), seq, reserved); });
+	}
+
+	// Queues a task that needs no work (e.g. a payload reused from another archive).
+	// It skips the workers but keeps its place in the output order.
+	void emplace_result(task_t&& result, size_t reserved)
+	{
+		size_t seq;
+		if (next_sequence(seq, reserved))
+			push_output(std::move(result), seq, reserved);
 	}
 
 	bool try_pop(task_t& result)
 	{
-		_out_mutex.lock();
-		if (_outputs.empty())
-		{
-			_out_mutex.unlock();
+		std::unique_lock lock(_out_mutex);
+		if (_error)
+			std::rethrow_exception(_error);
+		if (!output_ready())
 			return false;
-		}
-		result = std::move(_outputs.front());
-		_outputs.pop_front();
-		_out_mutex.unlock();
-		_mem_usage -= result.second.size();
+		take_output(result, lock);
 		return true;
 	}
 
+	// Blocks until a result is available. Throws if a worker failed or the compressor was stopped.
 	task_t pop()
 	{
 		task_t result;
-		bool succ;
-		while (true)
-		{
-			succ = try_pop(result);
-			if (succ)
-				return std::move(result);
-			std::this_thread::sleep_for(std::chrono::milliseconds(1));
-		}
+		std::unique_lock lock(_out_mutex);
+		_out_cv.wait(lock, [this]() { return _error || output_ready() || _should_stop; });
+		if (_error)
+			std::rethrow_exception(_error);
+		if (!output_ready())
+			throw std::runtime_error("The compressor was stopped.");
+		take_output(result, lock);
+		return result;
 	}
 
-	void start(Mode mode)
+	void start(Mode mode, Order order = Order::completion)
 	{
 		if (_state != State::idle)
-			throw std::exception("Compressor is already busy!");
+			throw std::runtime_error("Compressor is already busy!");
 		if (options.verbose)
 		{
 			std::cout << "Starting " << (mode == Mode::compress ? "compression" : "decompression")
 				<< " with " << _thread_count << " threads.\n";
 		}
 		_should_stop = false;
+		_order = order;
+		_next_in = _next_out = 0;
 		_state = mode == Mode::compress ? State::compressing : State::decompressing;
-		for (int i = 0; i < _thread_count; i++)
-			_threads[i] = std::thread(&MultithreadCompressor::thread_main, this, i);
+		_pool = std::make_unique<ThreadPool>(_thread_count);
 	}
 
-	void stop() { _should_stop = true; }
+	// Skips the tasks that have not been started yet and wakes up everyone waiting in pop().
+	void stop()
+	{
+		{
+			std::scoped_lock lock(_out_mutex, _mem_mutex);
+			_should_stop = true;
+		}
+		_out_cv.notify_all();
+		_window_cv.notify_all();
+		_mem_cv.notify_all();
+	}
 
+	// Waits for all queued tasks (unless stopped) and joins the worker threads.
 	void stop_wait()
 	{
 		if (_state == State::idle)
 			return;
-		_should_stop = true;
-		for (auto& t : _threads)
-			t.join();
+		_pool->shutdown();
+		_pool.reset();
+		_state = State::idle;
 	}
 
-	size_t memory_usage() { return _mem_usage; }
+	size_t memory_limit() const { return _mem_limit; }
+
+	size_t memory_usage()
+	{
+		std::lock_guard lock(_mem_mutex);
+		return _mem_usage;
+	}
+
+	size_t peak_memory_usage()
+	{
+		std::lock_guard lock(_mem_mutex);
+		return _mem_peak;
+	}
+
+	// Peak memory of compressing input_size bytes: the input next to the ZLC scratch buffer
+	// and the result copied out of it, then the ZLC result next to the RLE buffer.
+	// The input is kept until it is clear that the result is smaller.
+	static size_t compress_cost(size_t input_size)
+	{
+		size_t stored = options.zlc ? Compressor::compress_bound(input_size) : input_size;
+		size_t zlc_phase = input_size + (options.zlc ? Compressor::scratch_size(input_size) + stored : 0);
+		size_t rle_phase = options.rle ? input_size + stored + rle::compress_bound(stored) : 0;
+		return std::max(zlc_phase, rle_phase);
+	}
+
+	// Payload plus the decoded layers, as far as the headers tell.
+	static size_t decompress_cost(std::span<const uint8_t> payload)
+	{
+		size_t cost = payload.size();
+		if (rle::is_compressed(payload))
+		{
+			cost += rle::decoded_size(payload);
+			payload = rle::leading_literals(payload); // the ZLC2 header, rle::compress keeps it literal
+		}
+		if (Compressor::is_compressed(payload))
+			cost += Compressor::decoded_size(payload);
+		return cost;
+	}
+
+	// Blocks until bytes fit into the budget. A task larger than the whole budget
+	// is let through once nothing else is in flight. Returns false if stopped.
+	bool acquire_memory(size_t bytes)
+	{
+		std::unique_lock lock(_mem_mutex);
+		_mem_cv.wait(lock, [&]() { return _should_stop || fits(bytes); });
+		if (_should_stop)
+			return false;
+		charge_memory(bytes);
+		return true;
+	}
+
+	// Like acquire_memory, but returns false instead of waiting.
+	bool try_acquire_memory(size_t bytes)
+	{
+		std::lock_guard lock(_mem_mutex);
+		if (_should_stop || !fits(bytes))
+			return false;
+		charge_memory(bytes);
+		return true;
+	}
+
+	void release_memory(size_t bytes)
+	{
+		{
+			std::lock_guard lock(_mem_mutex);
+			_mem_usage -= bytes;
+		}
+		_mem_cv.notify_all();
+	}
 
 private:
+	// guarded by _mem_mutex
+	bool fits(size_t bytes) const
+	{
+		return _mem_usage == 0 || bytes <= _mem_limit - std::min(_mem_usage, _mem_limit);
+	}
 
-	void thread_main(int tid)
+	void release_input(std::vector<uint8_t>&& input)
 	{
-		size_t input_size;
+		if (_buffers)
+			_buffers->give(std::move(input));
+	}
 
-		_threads_busy[tid] = true;
+	// never blocks, used by the workers when the estimate was too low
+	void charge_memory(size_t bytes)
+	{
+		_mem_usage += bytes;
+		_mem_peak = std::max(_mem_peak, _mem_usage);
+	}
+
+	void grow_charge(size_t& charge, size_t needed)
+	{
+		if (needed <= charge)
+			return;
+		std::lock_guard lock(_mem_mutex);
+		charge_memory(needed - charge);
+		charge = needed;
+	}
 
-		while (!_should_stop)
+	// results that wait for an earlier one stay in the map (and in the memory budget)
+	size_t reorder_window() const { return 4 * (size_t)_thread_count; }
+
+	// Returns false if the task has to be dropped because the compressor was stopped.
+	bool next_sequence(size_t& seq, size_t reserved)
+	{
+		if (_state == State::idle)
+		{
+			release_memory(reserved);
+			throw std::runtime_error("Compressor is not running!");
+		}
+
+		{
+			std::unique_lock lock(_out_mutex);
+			seq = _next_in++;
+			if (_order == Order::input)
+				_window_cv.wait(lock, [&]() { return seq < _next_out + reorder_window() || _should_stop; });
+		}
+		if (_should_stop)
 		{
-			_in_mutex.lock();
-			if (_inputs.empty())
+			// dropped like the tasks the workers skip
+			release_memory(reserved);
+			return false;
+		}
+		return true;
+	}
+
+	void push_output(task_t&& task, size_t seq, size_t charge)
+	{
+		// only the result stays alive until it is popped
+		size_t output_charge = task.second.capacity();
+		grow_charge(charge, output_charge);
+		release_memory(charge - output_charge);
+		if (_task_finished_callback)
+			_task_finished_callback(task);
+
+		{
+			std::lock_guard lock(_out_mutex);
+			_outputs.emplace(seq, Output{ std::move(task), output_charge });
+		}
+		_out_cv.notify_all(); // in input order only one of the waiting consumers may be able to continue
+	}
+
+	bool output_ready() const
+	{
+		if (_outputs.empty())
+			return false;
+		return _order == Order::completion || _outputs.begin()->first == _next_out;
+	}
+
+	void take_output(task_t& result, std::unique_lock<std::mutex>& lock)
+	{
+		auto it = _outputs.begin();
+		size_t charge = it->second.charge;
+		result = std::move(it->second.task);
+		_outputs.erase(it);
+		_next_out++;
+		lock.unlock();
+		_window_cv.notify_all();
+		release_memory(charge);
+	}
+
+	// a file that is compressed in chunks, the worker that finishes the last chunk completes it
+	struct ChunkedTask
+	{
+		task_t task;
+		size_t seq;
+		size_t charge;
+		std::optional<CompressionCache::Key> key;
+		StorePolicy::Report report;
+		std::vector<typename Compressor::chunk> chunks;
+		std::atomic<size_t> remaining;
+		std::atomic<bool> failed = false;
+	};
+
+	// reported to the consumer by try_pop and pop
+	void fail(size_t charge)
+	{
+		{
+			std::lock_guard lock(_out_mutex);
+			if (!_error)
+				_error = std::current_exception();
+		}
+		_out_cv.notify_all();
+		release_memory(charge);
+	}
+
+	void report_task(const task_t& task, StorePolicy::Report& report)
+	{
+		report.output_size = task.second.size();
+		if (_task_report_callback)
+			_task_report_callback(task.first, report);
+	}
+
+	// everything after ZLC: the RLE layer, the store check and the cache
+	// input is the raw file if ZLC was applied, task.second still is without ZLC
+	void finish_compression(task_t& task, std::vector<uint8_t>&& input, const std::optional<CompressionCache::Key>& key, StorePolicy::Report& report)
+	{
+		if (options.rle)
+		{
+			// outer layer, the extractor decodes RLE0 before ZLC2
+			auto packed = rle::compress(task.second);
+			if (packed.size() < task.second.size())
+				task.second = std::move(packed);
+		}
+		if (options.zlc && options.store != StoreMode::NEVER)
+			StorePolicy::store_if_not_smaller(task.second, input, report);
+		release_input(std::move(input));
+		if (_cache)
+			_cache->put(*key, task.second);
+		report_task(task, report);
+	}
+
+	void compress_chunk(const std::shared_ptr<ChunkedTask>& job, size_t index)
+	{
+		try
+		{
+			if (!_should_stop && !job->failed)
+				job->chunks[index] = Compressor::compress_chunk(job->task.second, index, options.level, arena().zlc);
+		}
+		catch (...)
+		{
+			if (!job->failed.exchange(true))
 			{
-				_in_mutex.unlock();
-				std::this_thread::sleep_for(std::chrono::milliseconds(1));
-				continue;
+				std::lock_guard lock(_out_mutex);
+				if (!_error)
+					_error = std::current_exception();
 			}
-			task_t task = std::move(_inputs.front());
-			_inputs.pop_front();
-			_in_mutex.unlock();
-			
-			input_size = task.second.size();
-			
+		}
+		if (--job->remaining != 0)
+			return;
+
+		if (_should_stop || job->failed)
+		{
+			_out_cv.notify_all();
+			release_memory(job->charge);
+			return;
+		}
+		try
+		{
+			auto input = std::move(job->task.second);
+			job->task.second = Compressor::stitch(input.size(), job->chunks);
+			job->chunks.clear();
+			finish_compression(job->task, std::move(input), job->key, job->report);
+		}
+		catch (...)
+		{
+			fail(job->charge);
+			return;
+		}
+		push_output(std::move(job->task), job->seq, job->charge);
+	}
+
+	void process(task_t task, size_t seq, size_t charge)
+	{
+		if (_should_stop)
+		{
+			release_memory(charge);
+			return;
+		}
+
+		try
+		{
 			if (_task_started_callback)
 				_task_started_callback(task);
 			if (_state == State::compressing)
-				task.second = std::move(Compressor::template compress<ZlcDict>(task.second));
-			else task.second = std::move(Compressor::decompress(task.second));
-			
-			_mem_usage -= input_size;
-			_mem_usage += task.second.size();
-			if (_task_finished_callback)
-				_task_finished_callback(task);
-
-			_out_mutex.lock();
-			_outputs.emplace_back(std::move(task));
-			_out_mutex.unlock();
-		}
-
-		_threads_busy[tid] = false;
-
-		// the last one out turns off the light
-		bool finished = true;
-		for (bool b : _threads_busy)
-			if (b) finished = false;
-		if (finished)
-			_state = State::idle;
+			{
+				std::optional<CompressionCache::Key> key;
+				std::optional<std::vector<uint8_t>> cached;
+				if (_cache)
+				{
+					key = CompressionCache::key(task.second);
+					cached = _cache->get(*key);
+				}
+
+				StorePolicy::Report report;
+				report.input_size = task.second.size();
+				const size_t chunks = options.zlc ? Compressor::chunk_count(task.second.size()) : 1;
+				if (cached)
+				{
+					release_input(std::move(task.second));
+					task.second = std::move(*cached);
+					report.decision = options.zlc ? StorePolicy::cached_decision(task.second) : StorePolicy::Decision::cached;
+					report_task(task, report);
+				}
+				else if (options.zlc && options.store == StoreMode::AUTO
+					&& !StorePolicy::worth_compressing(task.second, options.level, arena().zlc, report))
+				{
+					// stored as it is, not cached since the estimate is cheap
+					report_task(task, report);
+				}
+				else if (chunks > 1 && _pool->size() > 1)
+				{
+					// the chunks go to the front of this worker's deque, idle workers steal them from the back
+					auto job = std::make_shared<ChunkedTask>();
+					job->task = std::move(task);
+					job->seq = seq;
+					job->charge = charge;
+					job->key = key;
+					job->report = report;
+					job->chunks.resize(chunks);
+					job->remaining = chunks;
+					for (size_t i = chunks; i-- > 1;)
+						_pool->submit([this, job, i]() { compress_chunk(job, i); });
+					compress_chunk(job, 0);
+					return;
+				}
+				else
+				{
+					std::vector<uint8_t> input;
+					if (options.zlc)
+					{
+						input = std::move(task.second);
+						task.second = Compressor::compress(input, options.level, arena().zlc);
+						arena().zlc.trim();
+					}
+					finish_compression(task, std::move(input), key, report);
+				}
+			}
+			else
+			{
+				// stored entries are passed through without copies
+				std::span<const uint8_t> data = task.second;
+				std::vector<uint8_t>& rle_buffer = arena().rle;
+				if (rle::is_compressed(data))
+				{
+					rle::decompress(data, rle_buffer);
+					data = rle_buffer;
+					// other packers may have split the ZLC2 header into runs
+					if (Compressor::is_compressed(data))
+						grow_charge(charge, task.second.size() + data.size() + Compressor::decoded_size(data));
+				}
+				if (Compressor::is_compressed(data))
+				{
+					auto output = _buffers ? _buffers->take(Compressor::decoded_size(data)) : std::vector<uint8_t>();
+					Compressor::decompress(data, output);
+					release_input(std::move(task.second));
+					task.second = std::move(output);
+				}
+				else if (data.data() == rle_buffer.data())
+					std::swap(task.second, rle_buffer); // the payload buffer becomes the next scratch buffer
+				if (rle_buffer.capacity() > ARENA_KEEP_SIZE)
+					std::vector<uint8_t>().swap(rle_buffer);
+			}
+		}
+		catch (...)
+		{
+			fail(charge);
+			return;
+		}
+
+		push_output(std::move(task), seq, charge);
 	}
 };
\ No newline at end of file
@@ -1,12 +1,27 @@
 #pragma once
 #include <string>
+#include <vector>
 #include <cstdint>
 
 enum class ExecutionMode
 {
 	EXTRACT,
 	PACK,
-	LIST
+	LIST,
+	TEST
+};
+
+enum class ListFormat
+{
+	TSV,
+	JSON
+};
+
+enum class StoreMode
+{
+	AUTO,     // estimate before compressing, store if the result is not smaller
+	FALLBACK, // always compress, store if the result is not smaller
+	NEVER     // always keep the compressed result
 };
 
 
@@ -14,13 +29,22 @@ struct Options
 {
 	ExecutionMode mode = ExecutionMode::EXTRACT;
 	bool verbose = false;
+	bool fsync = false; // flush every extracted file to the disk
 	bool rle = false;
 	bool zlc = true;
 	int threads = 0;
+	int level = 5;
+	StoreMode store = StoreMode::AUTO;
+	size_t max_memory = (size_t)2 << 30; // budget of the (de)compression pipeline in bytes
+	ListFormat list_format = ListFormat::TSV;
 	int version = 2;
 	uint32_t key = 0;
 	std::string input;
 	std::string output;
+	std::string base; // previous archive to take unchanged payloads from
+	std::string cache_dir; // compression cache, disabled if empty
+	uint64_t cache_size = (uint64_t)4 << 30;
+	std::vector<std::string> entries; // extract only these
 };
 
 extern Options options;
\ No newline at end of file
@@ -0,0 +1,216 @@
+#pragma once
+#include <span>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+#include <filesystem>
+
+#include <cerrno>
+#include <cstdint>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// The directory the extracted files go to. On POSIX the files are opened relative to a descriptor
+// of the directory (openat), so its path is not looked up again for every file. Larger files get
+// their space up front (fallocate), a file that is in memory as a whole is written with one call.
+// Can be written to from several threads, it also counts what was written.
+class OutputDirectory
+{
+public:
+	// smaller files are allocated by their single write anyway, the extra call only costs time
+	static constexpr uint64_t PREALLOCATE_MIN = 1 << 20;
+
+	// A file that is being written, the pieces are appended.
+	class File
+	{
+		friend class OutputDirectory;
+
+		OutputDirectory& _dir;
+		std::string _name;
+		uint64_t _pos = 0;
+		uint64_t _reserved = 0; // preallocated, if more than was written the rest is released on close
+#ifdef _WIN32
+		HANDLE _handle = INVALID_HANDLE_VALUE;
+#else
+		int _fd = -1;
+#endif
+
+		// size is only a hint for the preallocation, 0 if it is not known
+		File(OutputDirectory& dir, const std::string& name, uint64_t size) :
+			_dir(dir),
+			_name(name)
+		{
+#ifdef _WIN32
+			_handle = CreateFileW((dir._path / name).c_str(), GENERIC_WRITE, 0, nullptr,
+				CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (_handle == INVALID_HANDLE_VALUE)
+				throw std::runtime_error("Unable to create " + path());
+			if (size >= PREALLOCATE_MIN)
+			{
+				// only a hint, the file system may not support it
+				FILE_ALLOCATION_INFO info;
+				info.AllocationSize.QuadPart = (LONGLONG)size;
+				SetFileInformationByHandle(_handle, FileAllocationInfo, &info, sizeof(info));
+			}
+#else
+			do
+				_fd = openat(dir._fd, name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+			while (_fd < 0 && errno == EINTR);
+			if (_fd < 0)
+				throw std::runtime_error("Unable to create " + path());
+#ifdef __linux__
+			// only a hint, the file system may not support it. The file size is left alone, so a
+			// stream that ends early does not leave the file padded with zeros.
+			if (size >= PREALLOCATE_MIN && fallocate(_fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)size) == 0)
+				_reserved = size;
+#endif
+#endif
+		}
+
+		std::string path() const { return (_dir._path / _name).string(); }
+
+		void close_handle()
+		{
+#ifdef _WIN32
+			if (_handle != INVALID_HANDLE_VALUE)
+				CloseHandle(_handle);
+			_handle = INVALID_HANDLE_VALUE;
+#else
+			if (_fd >= 0)
+				::close(_fd);
+			_fd = -1;
+#endif
+		}
+
+	public:
+		File(const File&) = delete;
+		File& operator=(const File&) = delete;
+
+		~File()
+		{
+			close_handle();
+		}
+
+		void write(std::span<const uint8_t> data)
+		{
+			while (!data.empty())
+			{
+#ifdef _WIN32
+				DWORD n = 0;
+				if (!WriteFile(_handle, data.data(), (DWORD)std::min<size_t>(data.size(), 1 << 30), &n, nullptr))
+					throw std::runtime_error("Unable to write " + path());
+#else
+				ssize_t n = pwrite(_fd, data.data(), data.size(), (off_t)_pos);
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n <= 0)
+					throw std::runtime_error("Unable to write " + path());
+#endif
+				data = data.subspan(n);
+				_pos += n;
+			}
+		}
+
+		// Flushes the file to the disk if the directory was opened with fsync. Errors are only
+		// reported here, the destructor closes silently.
+		void close()
+		{
+#ifdef _WIN32
+			bool ok = !_dir._fsync || FlushFileBuffers(_handle);
+#elif defined(__linux__)
+			bool ok = _pos >= _reserved || ftruncate(_fd, (off_t)_pos) == 0;
+			ok = (!_dir._fsync || fdatasync(_fd) == 0) && ok;
+#else
+			bool ok = !_dir._fsync || fsync(_fd) == 0;
+#endif
+#ifdef _WIN32
+			ok = CloseHandle(_handle) && ok;
+			_handle = INVALID_HANDLE_VALUE;
+#else
+			ok = ::close(_fd) == 0 && ok;
+			_fd = -1;
+#endif
+			if (!ok)
+				throw std::runtime_error("Unable to write " + path());
+			_dir._files++;
+			_dir._bytes += _pos;
+		}
+	};
+
+private:
+	typedef std::chrono::steady_clock clock;
+
+	std::filesystem::path _path;
+	const bool _fsync;
+#ifndef _WIN32
+	int _fd = -1;
+#endif
+
+	std::atomic<size_t> _files = 0;
+	std::atomic<uint64_t> _bytes = 0;
+	const clock::time_point _start = clock::now();
+	double _seconds = 0;
+
+public:
+	// The directory has to exist. fsync: every file is on the disk before it counts as written.
+	OutputDirectory(const std::filesystem::path& path, bool fsync) :
+		_path(path),
+		_fsync(fsync)
+	{
+#ifndef _WIN32
+		_fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (_fd < 0)
+			throw std::runtime_error("Unable to open the directory " + path.string());
+#endif
+	}
+
+	OutputDirectory(const OutputDirectory&) = delete;
+	OutputDirectory& operator=(const OutputDirectory&) = delete;
+
+	~OutputDirectory()
+	{
+#ifndef _WIN32
+		::close(_fd);
+#endif
+	}
+
+	File create(const std::string& name, uint64_t size = 0)
+	{
+		return File(*this, name, size);
+	}
+
+	// Writes a file that is in memory as a whole.
+	void write(const std::string& name, std::span<const uint8_t> data)
+	{
+		File file = create(name, data.size());
+		file.write(data);
+		file.close();
+	}
+
+	// Stops the clock. With fsync the new directory entries are flushed too.
+	void finish()
+	{
+#ifndef _WIN32
+		if (_fsync && fsync(_fd) != 0)
+			throw std::runtime_error("Unable to write " + _path.string());
+#endif
+		_seconds = std::chrono::duration<double>(clock::now() - _start).count();
+	}
+
+	size_t files() const { return _files; }
+	uint64_t bytes() const { return _bytes; }
+	double seconds() const { return _seconds; }
+};
\ No newline at end of file
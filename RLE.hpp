@@ -1,6 +1,14 @@
 #pragma once
+#include <span>
 #include <vector>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
 #include <exception>
+#include <stdexcept>
+
+#include "Simd.hpp"
+#include "CodecResult.hpp"
 
 class rle
 {
@@ -15,34 +23,190 @@ private:
 		uint32_t unknown2;
 	};
 
+	static constexpr size_t MAX_LITERALS = 64;
+	static constexpr size_t MAX_REPEAT = 65;
+	static constexpr size_t MAX_WIDTH = 3;
+	static constexpr size_t MIN_SAVING = 2; // a run also ends the current literal run
+
+	// Signature and size of an inner ZLC2 stream. They stay in the first literal run, so the
+	// size of the file can be read without decoding (leading_literals).
+	static size_t inner_header_size(std::span<const uint8_t> input)
+	{
+		return input.size() >= 8 && std::memcmp(input.data(), "ZLC2", 4) == 0 ? 8 : 0;
+	}
 
 public:
+	// worst case: one control byte per 64 literals
+	static size_t compress_bound(size_t input_size)
+	{
+		return sizeof(Rle0Header) + input_size + (input_size + MAX_LITERALS - 1) / MAX_LITERALS;
+	}
+
+	// Encodes repetitions of 1 to 3 byte patterns (2 to 65 times) as runs,
+	// everything else as literal runs of up to 64 bytes.
 	static std::vector<uint8_t> compress(const std::vector<uint8_t>& input)
 	{
-		//Rle0Header hdr;
-		//hdr.signature = '0ELR';
-		//hdr.depth = 
+		std::vector<uint8_t> output(compress_bound(input.size()));
+		output.resize(compress(input, output).size);
+		return output;
+	}
+
+	// Compresses into output, which needs compress_bound(input.size()) bytes.
+	static codec_result compress(std::span<const uint8_t> input, std::span<uint8_t> output)
+	{
+		if (output.size() < compress_bound(input.size()))
+			return { 0, codec_error::output_too_small };
+		uint8_t* out = output.data() + sizeof(Rle0Header);
+
+		const uint8_t* literals = input.data(); // start of the pending literal run
+		const uint8_t* pos = literals + inner_header_size(input);
+		const uint8_t* end = literals + input.size();
+
+		auto flush_literals = [&](const uint8_t* to) {
+			while (literals < to)
+			{
+				size_t n = std::min<size_t>(to - literals, MAX_LITERALS);
+				*out++ = (uint8_t)(n & 0x3F);
+				std::memcpy(out, literals, n);
+				out += n;
+				literals += n;
+			}
+		};
+
+		while ((pos = simd::find_repeat(pos, end)) < end)
+		{
+			size_t best_width = 0, best_count = 0, best_saving = 0;
+			for (size_t width = 1; width <= MAX_WIDTH && (size_t)(end - pos) >= 2 * width; width++)
+			{
+				size_t max = std::min<size_t>(end - pos - width, (MAX_REPEAT - 1) * width);
+				size_t count = 1 + simd::match_length(pos + width, pos, max) / width;
+				if (count * width < 1 + width + MIN_SAVING) // control byte + pattern
+					continue;
+				size_t saving = count * width - (1 + width);
+				if (saving > best_saving)
+				{
+					best_width = width;
+					best_count = count;
+					best_saving = saving;
+				}
+			}
+
+			if (!best_width)
+			{
+				pos++;
+				continue;
+			}
+
+			flush_literals(pos);
+			*out++ = (uint8_t)(best_width << 6 | ((best_count - 1) & 0x3F));
+			std::memcpy(out, pos, best_width);
+			out += best_width;
+			pos += best_count * best_width;
+			literals = pos;
+		}
+		flush_literals(end);
+
+		Rle0Header hdr;
+		hdr.signature = '0ELR';
+		hdr.depth = 0; // unknown, ignored by the decoder
+		hdr.length = (uint32_t)(out - output.data() - sizeof(Rle0Header));
+		hdr.original_length = (uint32_t)input.size();
+		hdr.is_compressed = 1;
+		hdr.unknown2 = 0;
+		std::memcpy(output.data(), &hdr, sizeof(hdr));
+
+		return { (size_t)(out - output.data()) };
+	}
+
+	// header probes, so the output can be sized before decoding
+	static bool is_compressed(std::span<const uint8_t> input)
+	{
+		if (input.size() < sizeof(Rle0Header))
+			return false;
+		int32_t signature;
+		std::memcpy(&signature, input.data(), sizeof(signature));
+		return signature == '0ELR';
+	}
+
+	static size_t decoded_size(std::span<const uint8_t> input)
+	{
+		if (!is_compressed(input))
+			return input.size();
+		Rle0Header hdr;
+		std::memcpy(&hdr, input.data(), sizeof(hdr));
+		return hdr.original_length;
+	}
 
-		throw std::exception("RLE compression is not yet implemented.");
+	// The decoded bytes that are available without decoding: the stored data or the first literal run.
+	static std::span<const uint8_t> leading_literals(std::span<const uint8_t> input)
+	{
+		if (!is_compressed(input))
+			return input;
+		Rle0Header hdr;
+		std::memcpy(&hdr, input.data(), sizeof(hdr));
+		auto body = input.subspan(sizeof(Rle0Header));
+
+		if (!hdr.is_compressed)
+			return body.first(std::min<size_t>(body.size(), hdr.original_length));
+		if (body.empty() || (body[0] >> 6) != 0)
+			return {};
+		size_t n = body[0] & 0x3F;
+		if (!n)
+			n = 0x40;
+		return body.subspan(1, std::min(n, body.size() - 1));
 	}
 
 	static std::vector<uint8_t> decompress(const std::vector<uint8_t>& input)
 	{
-		if (input.size() < sizeof(Rle0Header))
-			return input; // TODO: avoid copy
-		const uint8_t* p = input.data();
-		const Rle0Header& hdr = *(const Rle0Header*)p;
-		p += sizeof(Rle0Header);
-		if (hdr.signature != '0ELR')
-			return input; // TODO: avoid copy
+		if (!is_compressed(input))
+			return input;
+		return decompress(std::span<const uint8_t>(input));
+	}
+
+	// Returns a copy of the input if it has no RLE0 header, use is_compressed to avoid that.
+	static std::vector<uint8_t> decompress(std::span<const uint8_t> input)
+	{
+		std::vector<uint8_t> output;
+		decompress(input, output);
+		return output;
+	}
 
-		std::vector<uint8_t> output(hdr.original_length);
+	// Decodes into output, which keeps its capacity from earlier calls.
+	// input must not point into output.
+	static void decompress(std::span<const uint8_t> input, std::vector<uint8_t>& output)
+	{
+		output.resize(decoded_size(input));
+		auto result = decompress(input, std::span<uint8_t>(output));
+		if (!result)
+			throw std::runtime_error(std::string("Invalid RLE0 stream: ") + result.message());
+	}
+
+	// Decodes into output, which needs decoded_size(input) bytes, and returns the bytes written.
+	// Input without RLE0 header is copied. input must not overlap output.
+	static codec_result decompress(std::span<const uint8_t> input, std::span<uint8_t> output)
+	{
+		const size_t original_size = decoded_size(input);
+		if (output.size() < original_size)
+			return { 0, codec_error::output_too_small };
+		if (!is_compressed(input))
+		{
+			if (!input.empty())
+				std::memcpy(output.data(), input.data(), input.size());
+			return { input.size(), codec_error::none, input.size() };
+		}
+
+		Rle0Header hdr;
+		std::memcpy(&hdr, input.data(), sizeof(hdr));
+		const uint8_t* p = input.data() + sizeof(Rle0Header);
+		const uint8_t* end = input.data() + input.size();
 
 		if (hdr.is_compressed)
 		{
 			auto out_p = output.data();
-			auto out_end = output.data() + output.size();
+			auto out_end = output.data() + original_size;
 			while (out_p < out_end) {
+				if (p >= end)
+					return { (size_t)(out_p - output.data()), codec_error::truncated, input.size() };
 				uint8_t  c = *p++;
 				uint32_t n = c & 0x3F;
 				c >>= 6;
@@ -53,6 +217,8 @@ public:
 
 				switch (c) {
 				case 0:
+					if ((size_t)(end - p) < n || (size_t)(out_end - out_p) < n)
+						return { (size_t)(out_p - output.data()), codec_error::invalid_run };
 					while (n--) {
 						*out_p++ = *p++;
 					}
@@ -62,6 +228,8 @@ public:
 				case 2:
 				case 3:
 					n++;
+					if ((size_t)(end - p) < c || (size_t)(out_end - out_p) < n * c)
+						return { (size_t)(out_p - output.data()), codec_error::invalid_run };
 					while (n--) {
 						for (uint32_t i = 0; i < c; i++) {
 							*out_p++ = *(p + i);
@@ -74,9 +242,161 @@ public:
 		}
 		else
 		{
-			memcpy(output.data(), p, output.size());
+			if ((size_t)(end - p) < original_size)
+				return { 0, codec_error::truncated, input.size() };
+			memcpy(output.data(), p, original_size);
+			p += original_size;
 		}
-
-		return output;
+		return { original_size, codec_error::none, (size_t)(p - input.data()) };
 	}
+
+	// Decodes a stream piece by piece, the runs can be split anywhere between two inputs.
+	// Like decompress, it passes input without RLE0 header through.
+	class decoder
+	{
+	private:
+		enum class Mode { raw, stored, runs };
+
+		uint64_t _input_left; // bytes of the stream that were not consumed yet
+		uint8_t _header[sizeof(Rle0Header)];
+		size_t _header_size = 0;
+		size_t _header_pos = 0; // header bytes passed through so far, if not compressed
+		bool _started = false; // the header is read
+		Mode _mode = Mode::raw;
+		uint64_t _output_size = 0;
+		uint64_t _written = 0;
+
+		size_t _run_left = 0; // bytes of the current run that are not written yet
+		size_t _width = 0; // pattern width of a repeated run, 0 for literals
+		uint8_t _pattern[MAX_WIDTH];
+		size_t _pattern_size = 0; // pattern bytes read so far
+		size_t _cycle = 0; // next pattern byte to write
+
+		codec_error decode_runs(const uint8_t*& in, const uint8_t* in_end, uint8_t*& out, uint8_t* out_end)
+		{
+			while (out < out_end && _written < _output_size)
+			{
+				if (_run_left && !_width)
+				{
+					size_t n = std::min<size_t>({ _run_left, (size_t)(in_end - in), (size_t)(out_end - out) });
+					if (!n)
+						break;
+					std::memcpy(out, in, n);
+					in += n;
+					out += n;
+					_written += n;
+					_run_left -= n;
+				}
+				else if (_run_left && _pattern_size < _width)
+				{
+					if (in == in_end)
+						break;
+					_pattern[_pattern_size++] = *in++;
+				}
+				else if (_run_left)
+				{
+					size_t n = std::min<size_t>(_run_left, out_end - out);
+					for (size_t i = 0; i < n; i++)
+					{
+						*out++ = _pattern[_cycle];
+						_cycle = _cycle + 1 == _width ? 0 : _cycle + 1;
+					}
+					_written += n;
+					_run_left -= n;
+				}
+				else
+				{
+					if (in == in_end)
+						break;
+					uint8_t c = *in++;
+					size_t n = c & 0x3F;
+					if (!n)
+						n = 0x40;
+					_width = c >> 6;
+					_run_left = _width ? (n + 1) * _width : n;
+					_pattern_size = _cycle = 0;
+					if (_run_left > _output_size - _written)
+						return codec_error::invalid_run;
+				}
+			}
+			return codec_error::none;
+		}
+
+	public:
+		// input_size is the size of the whole stream
+		explicit decoder(uint64_t input_size) :
+			_input_left(input_size)
+		{
+		}
+
+		// Consumes a part of input (it is advanced past the consumed bytes) and writes as much
+		// as fits into output. Returns the bytes written.
+		codec_result decode(std::span<const uint8_t>& input, std::span<uint8_t> output)
+		{
+			if (input.size() > _input_left)
+				input = input.first(_input_left);
+			const bool last = input.size() == _input_left;
+			const uint8_t* in = input.data();
+			const uint8_t* in_end = in + input.size();
+			uint8_t* out = output.data();
+			uint8_t* out_end = out + output.size();
+			codec_error error = codec_error::none;
+
+			if (!_started)
+			{
+				size_t n = std::min<size_t>(sizeof(_header) - _header_size, in_end - in);
+				if (n)
+					std::memcpy(_header + _header_size, in, n);
+				_header_size += n;
+				in += n;
+				if (_header_size == sizeof(_header) || last) // shorter streams cannot have a header
+				{
+					_started = true;
+					auto header = std::span<const uint8_t>(_header, _header_size);
+					if (is_compressed(header))
+					{
+						Rle0Header hdr;
+						std::memcpy(&hdr, _header, sizeof(hdr));
+						_mode = hdr.is_compressed ? Mode::runs : Mode::stored;
+						_output_size = hdr.original_length;
+					}
+					else
+						_output_size = _header_size + (_input_left - n);
+				}
+			}
+
+			if (_started)
+			{
+				if (_mode == Mode::runs)
+					error = decode_runs(in, in_end, out, out_end);
+				else
+				{
+					if (_mode == Mode::raw)
+					{
+						while (_header_pos < _header_size && out < out_end)
+							*out++ = _header[_header_pos++];
+					}
+					size_t n = std::min<uint64_t>({ (uint64_t)(in_end - in), (uint64_t)(out_end - out), _output_size - _written - (out - output.data()) });
+					if (n)
+						std::memcpy(out, in, n);
+					in += n;
+					out += n;
+					_written += out - output.data();
+				}
+			}
+
+			// stopped for input that will never come
+			if (error == codec_error::none && last && in == in_end && out < out_end && !done())
+				error = codec_error::truncated;
+
+			_input_left -= in - input.data();
+			input = input.subspan(in - input.data());
+			return { (size_t)(out - output.data()), error };
+		}
+
+		bool done() const { return _started && _written == _output_size; }
+		// valid once the header is read
+		uint64_t decoded_size() const { return _output_size; }
+		uint64_t written() const { return _written; }
+	};
 };
\ No newline at end of file
@@ -0,0 +1,172 @@
+#pragma once
+#include <bit>
+#include <cstdint>
+#include <cstring>
+
+#if defined(_M_X64) || defined(__x86_64__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define BETTERFPK_SSE2
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define BETTERFPK_TARGET_AVX2
+#else
+#define BETTERFPK_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// Byte comparison kernels shared by the match finders.
+// All variants return exactly the same results, so the CPU dispatch never changes the output.
+class simd
+{
+private:
+	typedef const uint8_t* (*find_byte_t)(const uint8_t*, const uint8_t*, uint8_t);
+
+	static uint64_t load64(const uint8_t* p)
+	{
+		uint64_t v;
+		std::memcpy(&v, p, sizeof(v));
+		return v;
+	}
+
+	static const uint8_t* find_byte_scalar(const uint8_t* begin, const uint8_t* end, uint8_t c)
+	{
+		const uint64_t pattern = 0x0101010101010101ull * c;
+		while (end - begin >= 8)
+		{
+			// classic "has zero byte" trick on the XORed word
+			uint64_t x = load64(begin) ^ pattern;
+			uint64_t zero = (x - 0x0101010101010101ull) & ~x & 0x8080808080808080ull;
+			if (zero)
+				return begin + std::countr_zero(zero) / 8;
+			begin += 8;
+		}
+		while (begin < end && *begin != c)
+			begin++;
+		return begin;
+	}
+
+#ifdef BETTERFPK_SSE2
+	static const uint8_t* find_byte_sse2(const uint8_t* begin, const uint8_t* end, uint8_t c)
+	{
+		const __m128i pattern = _mm_set1_epi8((char)c);
+		while (end - begin >= 16)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i*)begin);
+			unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, pattern));
+			if (mask)
+				return begin + std::countr_zero(mask);
+			begin += 16;
+		}
+		return find_byte_scalar(begin, end, c);
+	}
+
+	BETTERFPK_TARGET_AVX2
+	static const uint8_t* find_byte_avx2(const uint8_t* begin, const uint8_t* end, uint8_t c)
+	{
+		const __m256i pattern = _mm256_set1_epi8((char)c);
+		while (end - begin >= 32)
+		{
+			__m256i v = _mm256_loadu_si256((const __m256i*)begin);
+			unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, pattern));
+			if (mask)
+				return begin + std::countr_zero(mask);
+			begin += 32;
+		}
+		return find_byte_sse2(begin, end, c);
+	}
+
+	static bool cpu_has_avx2()
+	{
+#ifdef _MSC_VER
+		int regs[4];
+		__cpuid(regs, 0);
+		if (regs[0] < 7)
+			return false;
+		__cpuid(regs, 1);
+		const bool osxsave = regs[2] & (1 << 27);
+		const bool avx = regs[2] & (1 << 28);
+		if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) // OS has to save the YMM registers
+			return false;
+		__cpuidex(regs, 7, 0);
+		return regs[1] & (1 << 5);
+#else
+		return __builtin_cpu_supports("avx2");
+#endif
+	}
+#endif
+
+	static find_byte_t select_find_byte()
+	{
+#ifdef BETTERFPK_SSE2
+		if (cpu_has_avx2())
+			return find_byte_avx2;
+		return find_byte_sse2;
+#else
+		return find_byte_scalar;
+#endif
+	}
+
+public:
+	// Number of equal leading bytes of a and b, at most max.
+	static size_t match_length(const uint8_t* a, const uint8_t* b, size_t max)
+	{
+		size_t n = 0;
+#ifdef BETTERFPK_SSE2
+		while (max - n >= 16)
+		{
+			__m128i va = _mm_loadu_si128((const __m128i*)(a + n));
+			__m128i vb = _mm_loadu_si128((const __m128i*)(b + n));
+			unsigned diff = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) ^ 0xFFFF;
+			if (diff)
+				return n + std::countr_zero(diff);
+			n += 16;
+		}
+#endif
+		while (max - n >= 8)
+		{
+			uint64_t diff = load64(a + n) ^ load64(b + n);
+			if (diff) // little endian: the lowest set bit belongs to the first differing byte
+				return n + std::countr_zero(diff) / 8;
+			n += 8;
+		}
+		while (n < max && a[n] == b[n])
+			n++;
+		return n;
+	}
+
+	// First position p with p + 3 < end where p[0] equals p[1], p[2] or p[3], so a run of a
+	// 1 to 3 byte pattern might start there. Returns end if there is none.
+	static const uint8_t* find_repeat(const uint8_t* begin, const uint8_t* end)
+	{
+#ifdef BETTERFPK_SSE2
+		while (end - begin >= 16 + 3)
+		{
+			__m128i v0 = _mm_loadu_si128((const __m128i*)begin);
+			__m128i eq = _mm_or_si128(
+				_mm_cmpeq_epi8(v0, _mm_loadu_si128((const __m128i*)(begin + 1))),
+				_mm_or_si128(
+					_mm_cmpeq_epi8(v0, _mm_loadu_si128((const __m128i*)(begin + 2))),
+					_mm_cmpeq_epi8(v0, _mm_loadu_si128((const __m128i*)(begin + 3)))));
+			unsigned mask = (unsigned)_mm_movemask_epi8(eq);
+			if (mask)
+				return begin + std::countr_zero(mask);
+			begin += 16;
+		}
+#endif
+		while (end - begin > 3)
+		{
+			if (begin[0] == begin[1] || begin[0] == begin[2] || begin[0] == begin[3])
+				return begin;
+			begin++;
+		}
+		return end;
+	}
+
+	// First occurrence of c in [begin, end) or end if there is none.
+	static const uint8_t* find_byte(const uint8_t* begin, const uint8_t* end, uint8_t c)
+	{
+		static const find_byte_t impl = select_find_byte();
+		return impl(begin, end, c);
+	}
+};
\ No newline at end of file
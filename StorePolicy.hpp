@@ -0,0 +1,203 @@
+#pragma once
+#include <span>
+#include <array>
+#include <cmath>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <algorithm>
+
+#include <cstdint>
+
+#include "ZLC.hpp"
+#include "RLE.hpp"
+
+// Decides when a file is stored as it is instead of compressed. Media (OGG, PNG, WebM)
+// is compressed already and ZLC only makes it larger. The extractor passes payloads
+// without ZLC2 or RLE0 header through, so those can be stored raw.
+class StorePolicy
+{
+public:
+	// spread over the whole file, headers and trailers alone tell little
+	static constexpr size_t SAMPLE_BLOCK = 4096;
+	static constexpr size_t SAMPLE_BLOCKS = 16;
+	// below this many bits per byte the file is compressed without a trial
+	static constexpr double MIN_ENTROPY = 7.5;
+	// the trial compresses this prefix, smaller files are simply compressed
+	static constexpr size_t TRIAL_SIZE = 64 << 10;
+	// the prefix has to shrink at least to this fraction
+	static constexpr double MAX_TRIAL_RATIO = 0.97;
+
+	enum class Decision
+	{
+		compressed,
+		cached,      // compressed result taken from the cache
+		skipped,     // stored, the estimate said it would not shrink
+		not_smaller  // stored, the compressed result was not smaller
+	};
+
+	struct Report
+	{
+		Decision decision = Decision::compressed;
+		size_t input_size = 0;
+		size_t output_size = 0;
+		double entropy = -1; // bits per byte of the sample, negative if not estimated
+		double trial_ratio = -1; // compressed/raw size of the prefix, negative if not tried
+
+		bool stored() const { return decision == Decision::skipped || decision == Decision::not_smaller; }
+
+		std::string str() const
+		{
+			char buf[128];
+			double ratio = input_size ? 100.0 * output_size / input_size : 100.0;
+			switch (decision)
+			{
+			case Decision::compressed:
+				snprintf(buf, sizeof(buf), "compressed to %.1f%%", ratio);
+				break;
+			case Decision::cached:
+				snprintf(buf, sizeof(buf), "cached, %.1f%%", ratio);
+				break;
+			case Decision::skipped:
+				snprintf(buf, sizeof(buf), "stored, %.2f bits/byte, prefix compressed to %.1f%%", entropy, 100 * trial_ratio);
+				break;
+			case Decision::not_smaller:
+				snprintf(buf, sizeof(buf), "stored, compressing did not make it smaller");
+				break;
+			}
+			return buf;
+		}
+	};
+
+	// Stored files and bytes of a packing run, added to by the worker threads.
+	class Stats
+	{
+	private:
+		std::atomic<size_t> _files = 0;
+		std::atomic<size_t> _stored_files = 0;
+		std::atomic<uint64_t> _stored_bytes = 0;
+
+	public:
+		void add(const Report& report)
+		{
+			_files++;
+			if (report.stored())
+			{
+				_stored_files++;
+				_stored_bytes += report.input_size;
+			}
+		}
+
+		size_t files() const { return _files; }
+		size_t stored_files() const { return _stored_files; }
+		uint64_t stored_bytes() const { return _stored_bytes; }
+	};
+
+private:
+	static bool trial(const std::vector<uint8_t>& prefix, int level, zlc::workspace& ws, Report& report)
+	{
+		report.trial_ratio = (double)zlc::compress(prefix, level, ws).size() / prefix.size();
+		if (report.trial_ratio <= MAX_TRIAL_RATIO)
+			return true;
+
+		report.decision = Decision::skipped;
+		return false;
+	}
+
+public:
+	// A payload that starts like a ZLC2 or RLE0 stream would be decoded by the extractor.
+	static bool can_store(std::span<const uint8_t> input)
+	{
+		return !zlc::is_compressed(input) && !rle::is_compressed(input);
+	}
+
+	// Cached results of a ZLC run without header were stored because they did not get smaller.
+	static Decision cached_decision(std::span<const uint8_t> payload)
+	{
+		return can_store(payload) ? Decision::not_smaller : Decision::cached;
+	}
+
+	// Order 0 entropy of evenly spaced blocks in bits per byte.
+	static double entropy(std::span<const uint8_t> input)
+	{
+		std::array<uint32_t, 256> counts{};
+		size_t total = 0;
+		auto count = [&](std::span<const uint8_t> block) {
+			for (uint8_t c : block)
+				counts[c]++;
+			total += block.size();
+		};
+
+		if (input.size() <= SAMPLE_BLOCK * SAMPLE_BLOCKS)
+			count(input);
+		else
+		{
+			const size_t step = (input.size() - SAMPLE_BLOCK) / (SAMPLE_BLOCKS - 1);
+			for (size_t i = 0; i < SAMPLE_BLOCKS; i++)
+				count(input.subspan(i * step, SAMPLE_BLOCK));
+		}
+		if (!total)
+			return 0;
+
+		double bits = 0;
+		for (uint32_t n : counts)
+		{
+			if (n)
+			{
+				double p = (double)n / total;
+				bits -= p * std::log2(p);
+			}
+		}
+		return bits;
+	}
+
+	// Estimates whether ZLC shrinks the input: a high entropy sample is checked by compressing
+	// a prefix. Fills the estimate into report and marks it skipped if the file should be stored.
+	static bool worth_compressing(const std::vector<uint8_t>& input, int level, zlc::workspace& ws, Report& report)
+	{
+		if (!can_store(input))
+			return true;
+		report.entropy = entropy(input);
+		if (report.entropy < MIN_ENTROPY || input.size() <= 2 * TRIAL_SIZE)
+			return true;
+
+		std::vector<uint8_t> prefix(input.begin(), input.begin() + TRIAL_SIZE);
+		return trial(prefix, level, ws, report);
+	}
+
+	// The same estimate for a file that is not loaded, read(offset, span) fills span from offset on.
+	template <typename R>
+	static bool worth_compressing(uint64_t size, R&& read, int level, zlc::workspace& ws, Report& report)
+	{
+		std::vector<uint8_t> prefix(std::min<uint64_t>(size, TRIAL_SIZE));
+		read(0, std::span<uint8_t>(prefix));
+		if (!can_store(prefix))
+			return true;
+
+		// the blocks entropy would take from the whole file
+		std::vector<uint8_t> sample(std::min<uint64_t>(size, SAMPLE_BLOCK * SAMPLE_BLOCKS));
+		if (size <= SAMPLE_BLOCK * SAMPLE_BLOCKS)
+			read(0, std::span<uint8_t>(sample));
+		else
+		{
+			const uint64_t step = (size - SAMPLE_BLOCK) / (SAMPLE_BLOCKS - 1);
+			for (size_t i = 0; i < SAMPLE_BLOCKS; i++)
+				read(i * step, std::span<uint8_t>(sample).subspan(i * SAMPLE_BLOCK, SAMPLE_BLOCK));
+		}
+		report.entropy = entropy(sample);
+		if (report.entropy < MIN_ENTROPY || size <= 2 * TRIAL_SIZE)
+			return true;
+		return trial(prefix, level, ws, report);
+	}
+
+	// Swaps the raw input into output if the compressed output is not smaller.
+	static bool store_if_not_smaller(std::vector<uint8_t>& output, std::vector<uint8_t>& input, Report& report)
+	{
+		if (output.size() < input.size() || !can_store(input))
+			return false;
+		std::swap(output, input);
+		report.decision = Decision::not_smaller;
+		return true;
+	}
+};
\ No newline at end of file
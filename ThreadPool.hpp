@@ -0,0 +1,181 @@
+#pragma once
+#include <deque>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+// Work stealing thread pool.
+// Every worker owns a deque: it takes its own jobs from the front and steals from the back
+// of the others when it runs dry. Idle workers sleep on a condition variable, the lock behind it
+// is only taken when somebody sleeps, so submitting and finishing jobs stays lock free otherwise.
+// Jobs must not throw, catch inside the job and report the error some other way.
+class ThreadPool
+{
+public:
+	typedef std::function<void()> job_t;
+
+private:
+	struct Worker
+	{
+		std::mutex mutex;
+		std::deque<job_t> jobs;
+	};
+
+	std::vector<std::unique_ptr<Worker>> _workers;
+	std::vector<std::thread> _threads;
+
+	std::mutex _sleep_mutex;
+	std::condition_variable _wake;
+	std::condition_variable _idle;
+	std::atomic<size_t> _queued = 0;  // submitted but not yet taken by a worker
+	std::atomic<size_t> _pending = 0; // submitted but not yet finished
+	std::atomic<bool> _stopping = false;
+	// Threads waiting on _wake and _idle. They count themselves under _sleep_mutex before checking
+	// the counters above, so whoever changes a counter and then sees nobody sleeping needs no lock.
+	std::atomic<size_t> _sleeping = 0;
+	std::atomic<size_t> _idle_waiters = 0;
+
+	std::atomic<unsigned> _next_worker = 0;
+
+	// index of the current thread in the pool that owns it
+	static inline thread_local const ThreadPool* t_pool = nullptr;
+	static inline thread_local size_t t_index = 0;
+
+	bool try_get(size_t index, job_t& job)
+	{
+		{
+			Worker& own = *_workers[index];
+			std::lock_guard lock(own.mutex);
+			if (!own.jobs.empty())
+			{
+				job = std::move(own.jobs.front());
+				own.jobs.pop_front();
+				return true;
+			}
+		}
+		for (size_t i = 1; i < _workers.size(); i++)
+		{
+			Worker& victim = *_workers[(index + i) % _workers.size()];
+			std::lock_guard lock(victim.mutex);
+			if (!victim.jobs.empty())
+			{
+				job = std::move(victim.jobs.back());
+				victim.jobs.pop_back();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// A sleeper is either still before its check and sees the new counters,
+	// or already waiting once the lock could be taken, so the notify reaches it.
+	void wake_sleepers()
+	{
+		std::lock_guard lock(_sleep_mutex);
+	}
+
+	void worker_main(size_t index)
+	{
+		t_pool = this;
+		t_index = index;
+
+		job_t job;
+		while (true)
+		{
+			if (try_get(index, job))
+			{
+				_queued--;
+
+				job();
+				job = nullptr;
+
+				if (--_pending == 0 && (_idle_waiters > 0 || _sleeping > 0))
+				{
+					wake_sleepers();
+					_idle.notify_all();
+					if (_stopping)
+						_wake.notify_all();
+				}
+				continue;
+			}
+
+			// running jobs may still submit more, so only leave once everything is done
+			std::unique_lock lock(_sleep_mutex);
+			_sleeping++;
+			_wake.wait(lock, [this]() { return _queued > 0 || (_stopping && _pending == 0); });
+			_sleeping--;
+			// another worker may have taken the job that woke this one, that is no reason to leave
+			if (_queued == 0 && _stopping && _pending == 0)
+				return;
+		}
+	}
+
+public:
+	ThreadPool(int threads)
+	{
+		if (threads < 1)
+			threads = 1;
+		for (int i = 0; i < threads; i++)
+			_workers.emplace_back(std::make_unique<Worker>());
+		for (int i = 0; i < threads; i++)
+			_threads.emplace_back(&ThreadPool::worker_main, this, i);
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	~ThreadPool()
+	{
+		shutdown();
+	}
+
+	size_t size() const { return _workers.size(); }
+
+	// Jobs submitted from a worker go to its own deque, others are spread round robin.
+	void submit(job_t job)
+	{
+		size_t index = t_pool == this ? t_index : _next_worker++ % _workers.size();
+		_pending++;
+		{
+			Worker& worker = *_workers[index];
+			std::lock_guard lock(worker.mutex);
+			if (t_pool == this)
+				worker.jobs.push_front(std::move(job));
+			else worker.jobs.push_back(std::move(job));
+		}
+		// the job has to be in a deque before a worker can see _queued > 0
+		_queued++;
+		if (_sleeping > 0)
+		{
+			wake_sleepers();
+			_wake.notify_one();
+		}
+	}
+
+	// Blocks until every submitted job has finished.
+	void wait_idle()
+	{
+		std::unique_lock lock(_sleep_mutex);
+		_idle_waiters++;
+		_idle.wait(lock, [this]() { return _pending == 0; });
+		_idle_waiters--;
+	}
+
+	// Finishes all submitted jobs and joins the workers.
+	void shutdown()
+	{
+		{
+			std::lock_guard lock(_sleep_mutex);
+			if (_stopping)
+				return;
+			_stopping = true;
+		}
+		_wake.notify_all();
+		for (auto& t : _threads)
+			t.join();
+	}
+};
\ No newline at end of file
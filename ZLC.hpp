@@ -1,9 +1,16 @@
 #pragma once
 #include <tuple>
+#include <array>
+#include <span>
 #include <vector>
 #include <cassert>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
 
 #include "ZlcDict.hpp"
+#include "CodecResult.hpp"
 
 class zlc
 {
@@ -12,75 +19,264 @@ private:
 	static constexpr size_t MIN_LENGTH = 3;
 	static constexpr size_t MAX_LENGTH = MIN_LENGTH + 15;
 
-public:
+	// token costs in bits (flag + payload), used by the optimal parser
+	static constexpr uint32_t LITERAL_COST = 9;
+	static constexpr uint32_t MATCH_COST = 17;
+
+	// the optimal parser works on blocks of this size to keep its tables small
+	static constexpr size_t OPTIMAL_BLOCK_SIZE = 1 << 16;
+	enum class Strategy { greedy, lazy, optimal };
+
+	// per position tables of the optimal parser
+	struct parse_tables
+	{
+		std::vector<uint16_t> offsets;
+		std::vector<uint8_t> lengths;
+		std::vector<uint32_t> costs;
+	};
+
+	struct LevelParams
+	{
+		Strategy strategy;
+		unsigned max_chain;
+	};
+
+	static constexpr LevelParams LEVELS[] = {
+		{ Strategy::greedy, 4 },     // 1
+		{ Strategy::greedy, 16 },    // 2
+		{ Strategy::greedy, 64 },    // 3
+		{ Strategy::lazy, 32 },      // 4
+		{ Strategy::lazy, 128 },     // 5
+		{ Strategy::lazy, 512 },     // 6
+		{ Strategy::optimal, 256 },  // 7
+		{ Strategy::optimal, 1024 }, // 8
+		{ Strategy::optimal, 4096 }, // 9
+	};
+
+	// Positions inside a MAX_LENGTH match walk only part of the chain, but never less than the
+	// lazy levels do at every position, or the optimal levels would compress worse than those.
+	static constexpr unsigned COVERED_CHAIN_DIVISOR = 32;
+
+	static constexpr unsigned covered_chain(unsigned depth)
+	{
+		unsigned lazy = 0;
+		for (const LevelParams& params : LEVELS)
+		{
+			if (params.strategy == Strategy::lazy)
+				lazy = std::max(lazy, params.max_chain);
+		}
+		return std::min(depth, std::max(depth / COVERED_CHAIN_DIVISOR, lazy));
+	}
+
+	// Writes the token stream: one flag byte (MSB first, 1 = match) followed by up to 8 tokens.
+	class token_writer
+	{
+		uint8_t* _out;
+		uint8_t* _flag_offset;
+		uint8_t _flag = 0;
+		uint8_t _flag_pos = 0x80;
+		size_t _count = 0;
+
+		void next_flag()
+		{
+			if (!_flag_pos) // 8 flags set
+			{
+				*_flag_offset = _flag;
+				_flag_offset = _out++;
+				_flag = 0;
+				_flag_pos = 0x80;
+			}
+		}
+
+	public:
+		token_writer(uint8_t* out) :
+			_out(out + 1), // first byte will be flags
+			_flag_offset(out)
+		{
+		}
+
+		void literal(uint8_t c)
+		{
+			next_flag();
+			*_out++ = c;
+			_flag_pos >>= 1;
+			_count++;
+		}
+
+		void match(size_t offset, size_t length)
+		{
+			next_flag();
+			_flag |= _flag_pos; // set compression flag
+			*_out++ = (uint8_t)offset;
+			*_out++ = (uint8_t)(((offset >> 4) & 0xF0) | (length - MIN_LENGTH));
+			_flag_pos >>= 1;
+			_count++;
+		}
+
+		// Re-emits count tokens of another stream, its flag groups do not have to line up with ours.
+		void append(const uint8_t* in, size_t count)
+		{
+			while (count)
+			{
+				uint8_t flags = *in++;
+				for (uint8_t bit = 0x80; bit && count; bit >>= 1, count--)
+				{
+					next_flag();
+					if (flags & bit)
+					{
+						_flag |= _flag_pos;
+						*_out++ = *in++;
+						*_out++ = *in++;
+					}
+					else *_out++ = *in++;
+					_flag_pos >>= 1;
+					_count++;
+				}
+			}
+		}
+
+		size_t count() const { return _count; }
+
+		// Hands the bytes before the open flag group to write and moves the group to base,
+		// where the writer started. Everything after the group's flag byte is kept.
+		template <typename W>
+		void flush(uint8_t* base, W&& write)
+		{
+			write(std::span<const uint8_t>(base, _flag_offset));
+			const size_t open = _out - _flag_offset;
+			std::memmove(base, _flag_offset, open);
+			_flag_offset = base;
+			_out = base + open;
+		}
+
+		uint8_t* finish()
+		{
+			*_flag_offset = _flag; // set flags one last time!!!
+			return _out;
+		}
+	};
+
+	// the fast decoder needs a full flag group of input and may write up to 32 bytes per match
+	static constexpr ptrdiff_t FAST_INPUT_MARGIN = 1 + 8 * 2;
+	static constexpr ptrdiff_t FAST_OUTPUT_MARGIN = 8 * MAX_LENGTH + 32;
+
+	// Copies a back-reference with wide moves. Writes past out + cnt (up to out + 32),
+	// so the caller has to guarantee that much space.
+	static void copy_match(uint8_t* out, size_t offset, size_t cnt)
+	{
+		const uint8_t* src = out - offset;
+		if (offset >= 16) {
+			std::memcpy(out, src, 16);
+			std::memcpy(out + 16, src + 16, 16);
+		}
+		else if (offset >= 8) {
+			std::memcpy(out, src, 8);
+			std::memcpy(out + 8, src + 8, 8);
+			std::memcpy(out + 16, src + 16, 8);
+		}
+		else {
+			// expand the pattern to 8 bytes, then continue with a distance that is
+			// a multiple of offset and at least 8 so the 8 byte moves do not overlap
+			for (size_t i = 0; i < 8; i++)
+				out[i] = src[i];
+			const size_t dist = (8 + offset - 1) / offset * offset;
+			for (size_t i = 8; i < cnt; i += 8)
+				std::memcpy(out + i, out + i - dist, 8);
+		}
+	}
+
 	template <typename D>
-	static std::vector<uint8_t> compress(const std::vector<uint8_t>& input)
+	static std::tuple<const uint8_t*, uint8_t> find_match(D& dict, const uint8_t* in_start, const uint8_t* in_pos, const uint8_t* in_end)
 	{
-		D dict;
+		const uint8_t* end = in_pos + MAX_LENGTH;
+		if (end > in_end)
+			end = in_end;
+		const uint8_t* win_start = in_pos - std::min<size_t>(in_pos - in_start, WINDOW_SIZE);
+		return dict.find_best_match(in_pos, (uint8_t)(end - in_pos), win_start, in_pos);
+	}
 
-		// worst case: size = 9/8 * in_size; 10/8 for rounding - edit: wtf did I do here? 10/8*in_size vs. 3*in_size? Whatever, it is working... 
-		// use minimum size of 1KB for small files (ISSUE #1)
-		std::vector<uint8_t> output(std::max<size_t>(input.size() * 3, 1024));
+	// Encodes into scratch and returns a copy of the used part.
+	template <typename F>
+	static std::vector<uint8_t> compress_with(const std::vector<uint8_t>& input, std::vector<uint8_t>& scratch, F&& encode)
+	{
+		// the scratch buffer only grows, so it is not zeroed again for every input
+		const size_t bound = compress_bound(input.size());
+		if (scratch.size() < bound)
+			scratch.resize(bound);
 
 		// write header
-		uint32_t* out_32 = (uint32_t*)output.data();
+		uint32_t* out_32 = (uint32_t*)scratch.data();
 		*out_32++ = (uint32_t)'2CLZ';
 		*out_32++ = (uint32_t)input.size();
-		
-		// compress
-		const uint8_t* in_start = input.data();
-		const uint8_t* in_pos = in_start;
-		const uint8_t* in_end = in_start + input.size();
-		uint8_t* out_pos = (uint8_t*)out_32;
-
-		const uint8_t* window;
-		const uint8_t* win_start;
-		const uint8_t* win_end;
-
-		int count = 0;
-		uint8_t flag_pos = 0x80;
-		uint8_t flag = 0;
-		uint8_t* flag_offset = out_pos++; // first byte will be flags
-		const uint8_t* end;
-		int str_len;
-		int match_offs;
-		uint16_t control;
-
-		uint8_t control1, control2;
 
-		while (in_pos < in_end)
-		{
-			if (!flag_pos) // 8 flags set
-			{
-				*flag_offset = flag;
-				flag_offset = out_pos++;
-				flag = 0;
-				flag_pos = 0x80;
-			}
+		token_writer writer((uint8_t*)out_32);
+		encode(input.data(), input.data(), input.data() + input.size(), writer);
 
-			end = in_pos + MAX_LENGTH;
-			if (end > in_end)
-				end = in_end;
-			str_len = end - in_pos;
-			win_start = in_pos - WINDOW_SIZE;
-			if (win_start < in_start)
-				win_start = in_start;
-			win_end = in_pos;
+		return std::vector<uint8_t>(scratch.data(), writer.finish());
+	}
 
-			auto [match_start, match_length] = dict.find_best_match(in_pos, str_len, win_start, win_end);
+	// The encoders emit the tokens for [in_begin, in_end). Matches may reach back to in_start,
+	// which is before in_begin when a chunk is primed with the preceding history.
+
+	// takes the longest match at every position
+	template <typename D>
+	static void encode_greedy(const uint8_t* in_start, const uint8_t* in_begin, const uint8_t* in_end, D& dict, token_writer& out)
+	{
+		const uint8_t* in_pos = in_begin;
+		while (in_pos < in_end)
+		{
+			auto [match_start, match_length] = find_match(dict, in_start, in_pos, in_end);
 
 			if (match_length >= MIN_LENGTH) // match found, save compressed
 			{
-				flag |= flag_pos; // set compression flag
-				str_len = match_length - 3;
-				match_offs = in_pos - match_start;
+				out.match(in_pos - match_start, match_length);
+				while (match_length != 0)
+				{
+					dict.add(in_pos);
+					++in_pos;
+					--match_length;
+				}
+			}
+			else // no (sufficient) match found, save uncompressed
+			{
+				dict.add(in_pos);
+				out.literal(*in_pos++);
+			}
+		}
+	}
 
-				control1 = match_offs;
-				control2 = (match_offs >> 4) & 0xF0;
-				control2 |= str_len;
+	// defers a match by one byte if the next position has a longer one
+	template <typename D>
+	static void encode_lazy(const uint8_t* in_start, const uint8_t* in_begin, const uint8_t* in_end, D& dict, token_writer& out)
+	{
+		const uint8_t* in_pos = in_begin;
+		if (in_pos == in_end)
+			return;
+		auto [match_start, match_length] = find_match(dict, in_start, in_pos, in_end);
 
-				*out_pos++ = control1;
-				*out_pos++ = control2;
+		while (in_pos < in_end)
+		{
+			if (match_length >= MIN_LENGTH)
+			{
+				if (match_length < MAX_LENGTH && in_pos + 1 < in_end)
+				{
+					dict.add(in_pos);
+					auto [next_start, next_length] = find_match(dict, in_start, in_pos + 1, in_end);
+					if (next_length > match_length)
+					{
+						out.literal(*in_pos++);
+						match_start = next_start;
+						match_length = next_length;
+						continue;
+					}
+					out.match(in_pos - match_start, match_length);
+					++in_pos;
+					--match_length;
+				}
+				else
+				{
+					out.match(in_pos - match_start, match_length);
+				}
 				while (match_length != 0)
 				{
 					dict.add(in_pos);
@@ -88,43 +284,490 @@ public:
 					--match_length;
 				}
 			}
-			else // no (sufficient) match found, save uncompressed
+			else
 			{
 				dict.add(in_pos);
-				*out_pos++ = *in_pos++;
+				out.literal(*in_pos++);
 			}
-			flag_pos >>= 1;
+
+			if (in_pos < in_end)
+				std::tie(match_start, match_length) = find_match(dict, in_start, in_pos, in_end);
 		}
-		*flag_offset = flag; // set flags one last time!!!
+	}
 
-		size_t total_size = out_pos - output.data();
-		output.resize(total_size);
+	// Minimizes the encoded size with a backwards dynamic program over the token costs.
+	// Every token costs one flag bit, so the flag bytes are covered by the per-token costs.
+	// Since all matches cost the same regardless of the offset, the longest match at a
+	// position also provides every shorter length (3..longest) at the same offset.
+	// The input is parsed in blocks; the last token of a block may run into the next one.
+	template <typename D>
+	static void encode_optimal(const uint8_t* in_start, const uint8_t* in_begin, const uint8_t* in_end, D& dict, parse_tables& tables, token_writer& out)
+	{
+		const size_t table_size = std::min<size_t>(in_end - in_begin, OPTIMAL_BLOCK_SIZE + MAX_LENGTH);
+		if (tables.costs.size() < table_size + 1)
+		{
+			tables.offsets.resize(table_size);
+			tables.lengths.resize(table_size);
+			tables.costs.resize(table_size + 1);
+		}
+		auto& offsets = tables.offsets;
+		auto& lengths = tables.lengths;
+		auto& costs = tables.costs;
+
+		const uint8_t* block = in_begin;
+		const uint8_t* scanned = in_begin; // matches are known up to here
+		// The positions inside a MAX_LENGTH match first try its offset and only walk a shorter part
+		// of the chain (covered_chain) if that is shorter. On repetitive input most of them walked all of it
+		// for a match that is not longer than the one they are already inside.
+		const uint8_t* covered = in_begin;
+		uint16_t cover_offset = 0;
+		while (block < in_end)
+		{
+			const size_t n = std::min<size_t>(in_end - block, OPTIMAL_BLOCK_SIZE);
+			const size_t avail = std::min<size_t>(in_end - block, table_size);
+
+			// collect the longest match for every position
+			for (; scanned < block + avail; ++scanned)
+			{
+				size_t i = scanned - block;
+				size_t match_length;
+				match_length = 0;
+				if (scanned < covered)
+				{
+					const size_t max = std::min<size_t>({ MAX_LENGTH, (size_t)(in_end - scanned), cover_offset });
+					match_length = simd::match_length(scanned - cover_offset, scanned, max);
+					offsets[i] = cover_offset;
+				}
+				if (match_length < MAX_LENGTH)
+				{
+					const unsigned depth = dict.max_chain();
+					if (scanned < covered)
+						dict.max_chain(covered_chain(depth));
+					auto [match_start, length] = find_match(dict, in_start, scanned, in_end);
+					dict.max_chain(depth);
+					if (length > match_length)
+					{
+						match_length = length;
+						offsets[i] = (uint16_t)(scanned - match_start);
+					}
+				}
+				if (match_length == MAX_LENGTH)
+				{
+					covered = scanned + MAX_LENGTH;
+					cover_offset = offsets[i];
+				}
+				lengths[i] = match_length >= MIN_LENGTH ? (uint8_t)match_length : 0;
+				dict.add(scanned);
+			}
+
+			// lengths[i] becomes the chosen token length (1 = literal) for i < n
+			for (size_t i = n; i <= avail; i++)
+				costs[i] = 0;
+			for (size_t i = n; i-- > 0;)
+			{
+				uint32_t best_cost = costs[i + 1] + LITERAL_COST;
+				uint8_t best_length = 1;
+				for (uint8_t l = MIN_LENGTH; l <= lengths[i]; l++)
+				{
+					uint32_t c = costs[i + l] + MATCH_COST;
+					if (c <= best_cost)
+					{
+						best_cost = c;
+						best_length = l;
+					}
+				}
+				costs[i] = best_cost;
+				lengths[i] = best_length;
+			}
+
+			size_t i = 0;
+			while (i < n)
+			{
+				if (lengths[i] == 1)
+					out.literal(block[i]);
+				else out.match(offsets[i], lengths[i]);
+				i += lengths[i];
+			}
+
+			// keep the matches of the positions after the last token for the next block
+			std::copy(offsets.begin() + i, offsets.begin() + avail, offsets.begin());
+			std::copy(lengths.begin() + i, lengths.begin() + avail, lengths.begin());
+			block += i;
+		}
+	}
+
+public:
+	// Memory of one compressing thread: the output scratch buffer, the match finder and the parser tables.
+	// Reused from input to input, so compressing many small files is not dominated by allocations.
+	// Must not be shared between threads.
+	class workspace
+	{
+		friend class zlc;
+		std::vector<uint8_t> scratch;
+		ZlcHashChain dict;
+		parse_tables tables;
+
+	public:
+		// larger scratch buffers are not kept between inputs, they would live outside the memory budget
+		static constexpr size_t KEEP_SIZE = 4 << 20;
+
+		// Frees the scratch buffer if a large input grew it beyond KEEP_SIZE.
+		// It is as large as the compress_bound of the largest input so far.
+		void trim()
+		{
+			if (scratch.capacity() > KEEP_SIZE)
+				std::vector<uint8_t>().swap(scratch);
+		}
+	};
+
+private:
+	static void encode_level(int level, const uint8_t* in_start, const uint8_t* in_begin, const uint8_t* in_end, workspace& ws, token_writer& out)
+	{
+		if (level < MIN_LEVEL || level > MAX_LEVEL)
+			throw std::out_of_range("Invalid ZLC compression level: " + std::to_string(level));
+
+		const LevelParams& params = LEVELS[level - MIN_LEVEL];
+		ZlcHashChain& dict = ws.dict;
+		dict.reset();
+		dict.max_chain(params.max_chain);
+		switch (params.strategy)
+		{
+		case Strategy::greedy:
+			encode_greedy(in_start, in_begin, in_end, dict, out);
+			break;
+		case Strategy::lazy:
+			encode_lazy(in_start, in_begin, in_end, dict, out);
+			break;
+		default:
+			encode_optimal(in_start, in_begin, in_end, dict, ws.tables, out);
+			break;
+		}
+	}
+
+public:
+	static constexpr int MIN_LEVEL = 1;
+	static constexpr int MAX_LEVEL = sizeof(LEVELS) / sizeof(LEVELS[0]);
+	static constexpr int DEFAULT_LEVEL = 5;
+
+	// Largest possible output: header, every byte a literal and one flag byte per 8 tokens
+	// (matches cover at least 3 bytes with 2). The writer always emits the first flag byte.
+	static size_t compress_bound(size_t input_size)
+	{
+		return 8 + input_size + input_size / 8 + 1;
+	}
+
+	// Size of the workspace buffer compress works in.
+	static size_t scratch_size(size_t input_size)
+	{
+		return compress_bound(input_size);
+	}
+
+	template <typename D>
+	static std::vector<uint8_t> compress(const std::vector<uint8_t>& input)
+	{
+		D dict;
+		return compress(input, dict);
+	}
+
+	template <typename D>
+	static std::vector<uint8_t> compress(const std::vector<uint8_t>& input, D& dict)
+	{
+		std::vector<uint8_t> scratch;
+		return compress_with(input, scratch, [&](const uint8_t* start, const uint8_t* begin, const uint8_t* end, token_writer& out) {
+			encode_greedy(start, begin, end, dict, out);
+		});
+	}
+
+	template <typename D>
+	static std::vector<uint8_t> compress_lazy(const std::vector<uint8_t>& input, D& dict)
+	{
+		std::vector<uint8_t> scratch;
+		return compress_with(input, scratch, [&](const uint8_t* start, const uint8_t* begin, const uint8_t* end, token_writer& out) {
+			encode_lazy(start, begin, end, dict, out);
+		});
+	}
+
+	template <typename D>
+	static std::vector<uint8_t> compress_optimal(const std::vector<uint8_t>& input, D& dict)
+	{
+		std::vector<uint8_t> scratch;
+		parse_tables tables;
+		return compress_with(input, scratch, [&](const uint8_t* start, const uint8_t* begin, const uint8_t* end, token_writer& out) {
+			encode_optimal(start, begin, end, dict, tables, out);
+		});
+	}
+
+	// Large inputs are compressed in chunks of CHUNK_SIZE bytes, so they can be spread over several
+	// threads. Every chunk can still reference the WINDOW_SIZE bytes before it, only its last token
+	// cannot run into the next chunk. The result does not depend on how the chunks are scheduled.
+	static constexpr size_t CHUNK_SIZE = 1 << 20;
+
+	struct chunk
+	{
+		std::vector<uint8_t> tokens; // token stream without header
+		size_t count = 0; // number of tokens
+	};
+
+	// 1 if the input is compressed in one piece
+	static size_t chunk_count(size_t input_size)
+	{
+		if (input_size < 2 * CHUNK_SIZE)
+			return 1;
+		return (input_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	}
+
+	static chunk compress_chunk(const std::vector<uint8_t>& input, size_t index, int level, workspace& ws)
+	{
+		const uint8_t* begin = input.data() + index * CHUNK_SIZE;
+		const uint8_t* end = begin + std::min(CHUNK_SIZE, input.size() - index * CHUNK_SIZE);
+		const uint8_t* start = begin - std::min<size_t>(index * CHUNK_SIZE, WINDOW_SIZE); // history
+
+		const size_t bound = compress_bound(end - begin);
+		if (ws.scratch.size() < bound)
+			ws.scratch.resize(bound);
+		token_writer writer(ws.scratch.data());
+		encode_level(level, start, begin, end, ws, writer);
+
+		chunk result;
+		result.tokens.assign(ws.scratch.data(), writer.finish());
+		result.count = writer.count();
+		return result;
+	}
+
+	// Joins the chunk streams into one ZLC2 stream, the flag groups are packed anew.
+	static std::vector<uint8_t> stitch(size_t input_size, const std::vector<chunk>& chunks)
+	{
+		// the joined stream never needs more flag bytes than the chunks had together
+		size_t tokens_size = 0;
+		for (auto& c : chunks)
+			tokens_size += c.tokens.size();
+		std::vector<uint8_t> output(8 + std::max<size_t>(tokens_size, 1));
+
+		uint32_t* out_32 = (uint32_t*)output.data();
+		*out_32++ = (uint32_t)'2CLZ';
+		*out_32++ = (uint32_t)input_size;
+
+		token_writer writer((uint8_t*)out_32);
+		for (auto& c : chunks)
+			writer.append(c.tokens.data(), c.count);
+		output.resize(writer.finish() - output.data());
 		return output;
 	}
 
+	static std::vector<uint8_t> compress(const std::vector<uint8_t>& input, int level)
+	{
+		workspace ws;
+		return compress(input, level, ws);
+	}
+
+	static std::vector<uint8_t> compress(const std::vector<uint8_t>& input, int level, workspace& ws)
+	{
+		// the scratch buffer only grows, so it is not zeroed again for every input
+		const size_t bound = compress_bound(input.size());
+		if (ws.scratch.size() < bound)
+			ws.scratch.resize(bound);
+		auto result = compress(input, ws.scratch, level, ws);
+		if (!result)
+			throw std::out_of_range("Invalid ZLC compression level: " + std::to_string(level));
+		return std::vector<uint8_t>(ws.scratch.data(), ws.scratch.data() + result.size);
+	}
+
+	// Compresses into output, which needs compress_bound(input.size()) bytes. Allocates nothing
+	// once the workspace has grown. Large inputs are encoded chunk by chunk into the same
+	// token stream, which is exactly what stitch makes of the chunks of compress_chunk.
+	// A level out of range is reported as invalid_argument, not thrown.
+	static codec_result compress(std::span<const uint8_t> input, std::span<uint8_t> output, int level, workspace& ws)
+	{
+		if (level < MIN_LEVEL || level > MAX_LEVEL)
+			return { 0, codec_error::invalid_argument };
+		if (output.size() < compress_bound(input.size()))
+			return { 0, codec_error::output_too_small };
+
+		uint32_t header[2] = { (uint32_t)'2CLZ', (uint32_t)input.size() };
+		std::memcpy(output.data(), header, sizeof(header));
+
+		token_writer writer(output.data() + sizeof(header));
+		const size_t chunks = chunk_count(input.size());
+		const uint8_t* data = input.data();
+		for (size_t i = 0; i < chunks; i++)
+		{
+			// a single chunk covers the whole input, even when it is larger than CHUNK_SIZE
+			const size_t first = i * CHUNK_SIZE;
+			const size_t last = i + 1 < chunks ? first + CHUNK_SIZE : input.size();
+			encode_level(level, data + first - std::min(first, WINDOW_SIZE), data + first, data + last, ws, writer);
+		}
+		return { (size_t)(writer.finish() - output.data()) };
+	}
+
+	static std::array<uint8_t, 8> make_header(size_t input_size)
+	{
+		std::array<uint8_t, 8> header;
+		uint32_t fields[2] = { (uint32_t)'2CLZ', (uint32_t)input_size };
+		std::memcpy(header.data(), fields, sizeof(fields));
+		return header;
+	}
+
+	// Compresses input that is not in memory: read(span) fills up to span.size() bytes and returns
+	// how many, 0 at the end. The tokens go to write(span) as soon as their flag group is complete.
+	// Only two chunks of input with WINDOW_SIZE bytes of history and their tokens are held, no matter
+	// how large the input is. The stream is the same compress makes of the whole input, but the
+	// header is written with original size 0, the caller patches it with make_header(returned size).
+	template <typename R, typename W>
+	static uint64_t compress_stream(R&& read, W&& write, int level, workspace& ws)
+	{
+		if (level < MIN_LEVEL || level > MAX_LEVEL)
+			throw std::out_of_range("Invalid ZLC compression level: " + std::to_string(level));
+
+		// until there are 2 chunks, the input might still be compressed in one piece
+		std::vector<uint8_t> buffer(WINDOW_SIZE + 2 * CHUNK_SIZE);
+		const size_t bound = compress_bound(2 * CHUNK_SIZE);
+		if (ws.scratch.size() < bound)
+			ws.scratch.resize(bound);
+
+		write(std::span<const uint8_t>(make_header(0)));
+		token_writer writer(ws.scratch.data());
+
+		uint64_t total = 0;
+		size_t history = 0, filled = 0; // buffer[0, history) is already encoded, the rest up to filled is not
+		bool eof = false;
+		while (!eof)
+		{
+			while (filled < buffer.size())
+			{
+				size_t n = read(std::span<uint8_t>(buffer).subspan(filled));
+				if (!n)
+				{
+					eof = true;
+					break;
+				}
+				filled += n;
+				total += n;
+			}
+
+			uint8_t* data = buffer.data();
+			if (total < 2 * CHUNK_SIZE) // all of it is in the buffer
+			{
+				encode_level(level, data, data, data + filled, ws, writer);
+				break;
+			}
+
+			// the chunks lie where compress would put them, the last one takes the rest
+			uint8_t* begin = data + history;
+			uint8_t* end = data + filled;
+			while ((size_t)(end - begin) >= CHUNK_SIZE || (eof && begin < end))
+			{
+				uint8_t* chunk_end = begin + std::min<size_t>(CHUNK_SIZE, end - begin);
+				encode_level(level, begin - std::min<size_t>(begin - data, WINDOW_SIZE), begin, chunk_end, ws, writer);
+				writer.flush(ws.scratch.data(), write);
+				begin = chunk_end;
+			}
+
+			history = std::min<size_t>(begin - data, WINDOW_SIZE);
+			filled = end - begin + history;
+			std::memmove(data, begin - history, filled);
+		}
+		write(std::span<const uint8_t>(ws.scratch.data(), writer.finish()));
+		return total;
+	}
+
+	// header probes, so the output can be sized before decoding
+	static bool is_compressed(std::span<const uint8_t> input)
+	{
+		if (input.size() < 8)
+			return false;
+		uint32_t magic;
+		std::memcpy(&magic, input.data(), sizeof(magic));
+		return magic == (uint32_t)'2CLZ';
+	}
+
+	static size_t decoded_size(std::span<const uint8_t> input)
+	{
+		if (!is_compressed(input))
+			return input.size();
+		uint32_t original_size;
+		std::memcpy(&original_size, input.data() + 4, sizeof(original_size));
+		return original_size;
+	}
+
 	static std::vector<uint8_t> decompress(const std::vector<uint8_t>& input)
+	{
+		if (!is_compressed(input))
+			return input;
+		return decompress(std::span<const uint8_t>(input));
+	}
+
+	// Returns a copy of the input if it has no ZLC2 header, use is_compressed to avoid that.
+	static std::vector<uint8_t> decompress(std::span<const uint8_t> input)
+	{
+		std::vector<uint8_t> output;
+		decompress(input, output);
+		return output;
+	}
+
+	// Decodes into output, which keeps its capacity from earlier calls.
+	// input must not point into output. Truncated streams are accepted, the missing part is zeroed.
+	static void decompress(std::span<const uint8_t> input, std::vector<uint8_t>& output)
+	{
+		output.resize(decoded_size(input));
+		auto result = decompress(input, std::span<uint8_t>(output));
+		if (!result && result.error != codec_error::truncated)
+			throw std::runtime_error(std::string("Invalid ZLC stream: ") + result.message());
+	}
+
+	// Decodes into output, which needs decoded_size(input) bytes, and returns the bytes written.
+	// Input without ZLC2 header is copied. input must not overlap output.
+	static codec_result decompress(std::span<const uint8_t> input, std::span<uint8_t> output)
 	{
 		// read header
-		if (input.size() < 8)
-			return input; // TODO: avoid copy
-		uint32_t* in_32 = (uint32_t*)input.data();
-		uint32_t magic = *in_32++;
-		if (magic != (uint32_t)'2CLZ')
-			return input; // TODO: avoid copy
-		uint32_t original_size = *in_32++;
+		const size_t original_size = decoded_size(input);
+		if (output.size() < original_size)
+			return { 0, codec_error::output_too_small };
+		if (!is_compressed(input))
+		{
+			if (!input.empty())
+				std::memcpy(output.data(), input.data(), input.size());
+			return { input.size(), codec_error::none, input.size() };
+		}
 
 		// decompress
-		std::vector<uint8_t> output(original_size);
-		uint32_t out_len = output.size();
+		uint32_t out_len = (uint32_t)original_size;
 		auto     out_buff = output.data();
 		auto buff = input.data();
 		auto len = input.size();
-		auto in_p = (uint8_t*)in_32;
+		auto in_p = buff + 8;
 
 		auto end = buff + len;
 		auto out_p = out_buff;
 		auto out_end = out_buff + out_len;
 
+		// fast path: bounds are checked once per flag group
+		while (end - in_p >= FAST_INPUT_MARGIN && out_end - out_p >= FAST_OUTPUT_MARGIN) {
+			uint8_t flags = *in_p++;
+
+			for (int i = 0; i < 8; i++) {
+				if (flags & 0x80) {
+					uint32_t offset = in_p[0] | (in_p[1] & 0xF0) << 4;
+					uint32_t cnt = (in_p[1] & 0x0F) + 3;
+					in_p += 2;
+
+					if (offset == 0) {
+						offset = 4096;
+					}
+					if (offset > (size_t)(out_p - out_buff))
+						return { (size_t)(out_p - out_buff), codec_error::invalid_reference };
+
+					copy_match(out_p, offset, cnt);
+					out_p += cnt;
+				}
+				else {
+					*out_p++ = *in_p++;
+				}
+
+				flags <<= 1;
+			}
+		}
+
+		// careful tail near the buffer ends
 		while (in_p < end && out_p < out_end) {
 			uint8_t flags = *in_p++;
 
@@ -142,10 +785,12 @@ public:
 					if (offset == 0) {
 						offset = 4096;
 					}
+					if (offset > (size_t)(out_p - out_buff))
+						return { (size_t)(out_p - out_buff), codec_error::invalid_reference };
 
 					for (uint32_t j = 0; j < cnt && out_p < out_end; j++) {
 						*out_p = *(out_p - offset);
-						*out_p++;
+						out_p++;
 					}
 				}
 				else {
@@ -156,6 +801,219 @@ public:
 			}
 		}
 
-		return output;
+		// a truncated stream must not leave the scratch bytes of the wide copies behind
+		if (out_p < out_end)
+		{
+			const size_t written = out_p - out_buff;
+			std::fill(out_p, out_end, 0);
+			return { written, codec_error::truncated, len };
+		}
+		return { out_len, codec_error::none, (size_t)(in_p - buff) };
 	}
+
+	// Decodes a stream piece by piece with a fixed amount of memory. Back-references never reach
+	// further than WINDOW_SIZE bytes, so the history fits into a ring buffer. Like decompress,
+	// it passes input without ZLC2 header through.
+	class decoder
+	{
+	private:
+		static constexpr size_t RING_MASK = WINDOW_SIZE - 1;
+
+		uint64_t _input_left; // bytes of the stream that were not consumed yet
+		uint8_t _header[8];
+		size_t _header_size = 0;
+		size_t _header_pos = 0; // header bytes passed through so far, if not compressed
+		bool _started = false; // the header is read
+		bool _compressed = false;
+		uint64_t _output_size = 0;
+		uint64_t _written = 0;
+
+		std::array<uint8_t, WINDOW_SIZE> _ring;
+		uint8_t _flags = 0;
+		unsigned _flag_count = 0; // tokens left in the flag group
+		int _match_byte = -1; // first byte of a match token that was split between two inputs
+		size_t _match_offset = 0;
+		size_t _match_left = 0; // bytes of the current match that are not written yet
+
+		// The history of the bytes written by this call is in the output itself,
+		// only the older bytes come from the ring. The ring is updated once at the end.
+		codec_error decode_tokens(const uint8_t*& in, const uint8_t* in_end, uint8_t*& out, uint8_t* out_end, bool last)
+		{
+			uint8_t* const out_begin = out;
+			const uint64_t base = _written;
+			codec_error error = codec_error::none;
+
+			while (out < out_end && _written < _output_size)
+			{
+				// fast path of decompress, once a whole window of history is in the output
+				if (!_match_left && !_flag_count && (size_t)(out - out_begin) >= WINDOW_SIZE)
+				{
+					uint8_t* p = out;
+					uint8_t* p_end = out + (size_t)std::min<uint64_t>(out_end - out, _output_size - _written);
+					while (in_end - in >= FAST_INPUT_MARGIN && p_end - p >= FAST_OUTPUT_MARGIN)
+					{
+						uint8_t flags = *in++;
+						for (int i = 0; i < 8; i++)
+						{
+							if (flags & 0x80)
+							{
+								size_t offset = in[0] | (in[1] & 0xF0) << 4;
+								size_t cnt = (in[1] & 0x0F) + MIN_LENGTH;
+								in += 2;
+								copy_match(p, offset ? offset : WINDOW_SIZE, cnt);
+								p += cnt;
+							}
+							else
+								*p++ = *in++;
+							flags <<= 1;
+						}
+					}
+					_written += p - out;
+					out = p;
+					if (out == out_end || _written == _output_size)
+						break;
+				}
+
+				if (_match_left)
+				{
+					size_t n = (size_t)std::min<uint64_t>({ _match_left, (size_t)(out_end - out), _output_size - _written });
+					if (_match_offset <= (size_t)(out - out_begin))
+					{
+						const uint8_t* src = out - _match_offset;
+						for (size_t i = 0; i < n; i++)
+							out[i] = src[i];
+					}
+					else
+					{
+						for (size_t i = 0; i < n; i++)
+						{
+							uint64_t pos = _written + i - _match_offset;
+							out[i] = pos >= base ? out_begin[pos - base] : _ring[pos & RING_MASK];
+						}
+					}
+					out += n;
+					_written += n;
+					_match_left -= n;
+					continue;
+				}
+
+				if (!_flag_count)
+				{
+					if (in == in_end)
+						break;
+					_flags = *in++;
+					_flag_count = 8;
+				}
+
+				if (_flags & 0x80)
+				{
+					if (_match_byte < 0)
+					{
+						if (in == in_end)
+							break;
+						_match_byte = *in++;
+					}
+					if (in == in_end)
+						break;
+					uint8_t b = *in++;
+					size_t offset = _match_byte | (b & 0xF0) << 4;
+					_match_byte = -1;
+					if (offset == 0)
+						offset = WINDOW_SIZE;
+					if (offset > _written)
+					{
+						error = codec_error::invalid_reference;
+						break;
+					}
+					_match_offset = offset;
+					_match_left = (b & 0x0F) + MIN_LENGTH;
+				}
+				else
+				{
+					if (in == in_end)
+						break;
+					*out++ = *in++;
+					_written++;
+				}
+				_flags <<= 1;
+				_flag_count--;
+			}
+
+			// keep the last WINDOW_SIZE bytes for the next call
+			size_t n = std::min<size_t>(out - out_begin, WINDOW_SIZE);
+			for (uint64_t pos = _written - n; pos < _written; )
+			{
+				size_t slot = pos & RING_MASK;
+				size_t chunk = (size_t)std::min<uint64_t>(WINDOW_SIZE - slot, _written - pos);
+				std::memcpy(&_ring[slot], out_begin + (pos - base), chunk);
+				pos += chunk;
+			}
+
+			// stopped for input that will never come
+			if (error == codec_error::none && last && in == in_end && out < out_end && _written < _output_size)
+				return codec_error::truncated;
+			return error;
+		}
+
+	public:
+		// input_size is the size of the whole stream
+		explicit decoder(uint64_t input_size) :
+			_input_left(input_size)
+		{
+		}
+
+		// Consumes a part of input (it is advanced past the consumed bytes) and writes as much as fits
+		// into output. Returns the bytes written. A truncated stream is reported once the last
+		// input byte is consumed, the missing part can be taken as zeros like decompress does.
+		codec_result decode(std::span<const uint8_t>& input, std::span<uint8_t> output)
+		{
+			if (input.size() > _input_left)
+				input = input.first(_input_left);
+			const bool last = input.size() == _input_left;
+			const uint8_t* in = input.data();
+			const uint8_t* in_end = in + input.size();
+			uint8_t* out = output.data();
+			uint8_t* out_end = out + output.size();
+			codec_error error = codec_error::none;
+
+			if (!_started)
+			{
+				size_t n = std::min<size_t>(sizeof(_header) - _header_size, in_end - in);
+				if (n)
+					std::memcpy(_header + _header_size, in, n);
+				_header_size += n;
+				in += n;
+				if (_header_size == sizeof(_header) || last) // shorter streams cannot have a header
+				{
+					_started = true;
+					_compressed = is_compressed(std::span<const uint8_t>(_header, _header_size));
+					_output_size = _compressed ? zlc::decoded_size(std::span<const uint8_t>(_header, _header_size))
+						: _header_size + (_input_left - n);
+				}
+			}
+
+			if (_started && _compressed)
+				error = decode_tokens(in, in_end, out, out_end, last);
+			else if (_started)
+			{
+				while (_header_pos < _header_size && out < out_end)
+					*out++ = _header[_header_pos++];
+				size_t n = std::min<size_t>(in_end - in, out_end - out);
+				if (n)
+					std::memcpy(out, in, n);
+				in += n;
+				out += n;
+				_written += out - output.data();
+			}
+
+			_input_left -= in - input.data();
+			input = input.subspan(in - input.data());
+			return { (size_t)(out - output.data()), error };
+		}
+
+		bool done() const { return _started && _written == _output_size; }
+		// valid once the header is read
+		uint64_t decoded_size() const { return _output_size; }
+		uint64_t written() const { return _written; }
+	};
 };
\ No newline at end of file
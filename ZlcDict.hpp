@@ -2,9 +2,13 @@
 
 #include <deque>
 #include <tuple>
+#include <array>
+#include <algorithm>
 
 #include <cstdint>
 
+#include "Simd.hpp"
+
 struct ZlcSearch
 {
 	std::tuple<const uint8_t*, uint8_t> find_best_match(
@@ -19,36 +23,17 @@ struct ZlcSearch
 		const uint8_t* best_start = nullptr;
 		uint8_t best_length = 0;
 		uint8_t cur_length;
-		uint8_t c;
 
-		const uint8_t* pos;
-		const uint8_t* end;
-		const uint8_t* str_pos;
-		while (window < win_end)
+		while ((window = simd::find_byte(window, win_end, *str)) < win_end)
 		{
-			if (*window == *str)
-			{
-				pos = window + 1;
-				end = window + len;
-				if (end > win_end)
-					end = win_end;
-				str_pos = str + 1;
-				cur_length = 1;
-
-				while (pos < end && *pos == *str_pos)
-				{
-					pos++;
-					str_pos++;
-					cur_length++;
-				}
+			cur_length = (uint8_t)simd::match_length(window, str, std::min<size_t>(len, win_end - window));
 
-				if (cur_length > best_length)
-				{
-					best_start = window;
-					best_length = cur_length;
-					if (best_length == len) // best possible match already found
-						break;
-				}
+			if (cur_length > best_length)
+			{
+				best_start = window;
+				best_length = cur_length;
+				if (best_length == len) // best possible match already found
+					break;
 			}
 
 			window++;
@@ -57,7 +42,7 @@ struct ZlcSearch
 		return { best_start, best_length };
 	}
 
-	void add(uint8_t c, const uint8_t* pos) {}
+	void add(const uint8_t*) {}
 };
 
 class ZlcDict
@@ -89,22 +74,13 @@ public:
 		auto it = entries.begin();
 		for (auto it_end = entries.end(); it != it_end; ++it)
 		{
-			const uint8_t* strpos = str + 1; // start at +1 offset because 0 is already known to be equal
 			const uint8_t* winpos = *it;
 			if (winpos < window) // elements are too old from here on
 			{
 				entries.erase(it, entries.end());
 				break;
 			}
-			const uint8_t* end = std::min(win_end, winpos + len);
-			winpos++;
-			length = 1;
-			while (winpos < end && *strpos == *winpos)
-			{
-				strpos++;
-				winpos++;
-				length++;
-			}
+			length = (uint8_t)simd::match_length(winpos, str, std::min<size_t>(win_end - winpos, len));
 			if (length == len) // cannot get better
 				return { *it, len };
 			if (length > best_length)
@@ -122,4 +98,135 @@ public:
 		characters[*pos].push_front(pos);
 	}
 
+};
+
+// Match finder using hash chains over the first 3 bytes of every position.
+// Positions are stored as indices in two fixed-size arrays: _head holds the newest position
+// per hash and _prev links every position to the previous one with the same hash.
+// Positions are inserted lazily in find_best_match, so add() does not need to know where
+// the input ends. The indices keep growing across reset(), which makes the entries of
+// earlier inputs look older than the window, so the tables rarely have to be cleared.
+class ZlcHashChain
+{
+public:
+	static constexpr size_t WINDOW_SIZE = 4096;
+	static constexpr size_t MIN_LENGTH = 3;
+	static constexpr unsigned DEFAULT_MAX_CHAIN = 64;
+
+private:
+	static constexpr unsigned HASH_BITS = 13;
+	static constexpr size_t HASH_SIZE = 1 << HASH_BITS;
+	static constexpr size_t PREV_SIZE = WINDOW_SIZE * 2; // must be larger than the window (offset 4096 is valid)
+	static constexpr size_t PREV_MASK = PREV_SIZE - 1;
+	static constexpr uint32_t NIL = UINT32_MAX;
+	static constexpr uint32_t MAX_FIRST_INDEX = 1u << 31; // leaves 2 GiB of indices for the input
+
+	std::array<uint32_t, HASH_SIZE> _head;
+	std::array<uint32_t, PREV_SIZE> _prev;
+
+	const uint8_t* _base = nullptr; // first byte of the input
+	const uint8_t* _next = nullptr; // next position to insert
+	uint32_t _first = 0; // index of _base
+	uint32_t _end = 0; // one past the last inserted index
+	unsigned _max_chain;
+
+	static uint32_t hash(const uint8_t* p)
+	{
+		uint32_t v = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+		return (v * 2654435761u) >> (32 - HASH_BITS);
+	}
+
+	uint32_t index(const uint8_t* pos) const { return _first + (uint32_t)(pos - _base); }
+
+	void insert(const uint8_t* pos)
+	{
+		uint32_t idx = index(pos);
+		uint32_t& head = _head[hash(pos)];
+		_prev[idx & PREV_MASK] = head;
+		head = idx;
+		_end = idx + 1;
+	}
+
+public:
+	ZlcHashChain(unsigned max_chain = DEFAULT_MAX_CHAIN) :
+		_max_chain(max_chain ? max_chain : 1)
+	{
+		_head.fill(NIL);
+	}
+
+	// Forgets the input, usually without touching the tables.
+	void reset()
+	{
+		if (_end > MAX_FIRST_INDEX)
+		{
+			_head.fill(NIL);
+			_end = 0;
+		}
+		_first = _end;
+		_base = _next = nullptr;
+	}
+
+	void max_chain(unsigned max_chain) { _max_chain = max_chain ? max_chain : 1; }
+	unsigned max_chain() const { return _max_chain; }
+
+	std::tuple<const uint8_t*, uint8_t> find_best_match(
+		const uint8_t* str,
+		uint8_t len,
+		const uint8_t* window,
+		const uint8_t* win_end)
+	{
+		if (!_base) // first call, the window starts at the beginning of the input
+			_base = _next = window;
+
+		// only positions with 3 bytes before win_end can be the start of a valid match
+		while (_next + MIN_LENGTH <= win_end)
+			insert(_next++);
+
+		if (len < MIN_LENGTH)
+			return { nullptr, 0 };
+
+		const uint8_t* best_match = nullptr;
+		uint8_t best_length = 0;
+		const uint32_t win_idx = index(window);
+		uint32_t cand = _head[hash(str)];
+		unsigned chain = _max_chain;
+
+		while (cand != NIL && cand >= win_idx)
+		{
+			const uint8_t* pos = _base + (cand - _first);
+			const uint8_t max = (uint8_t)std::min<size_t>(len, win_end - pos);
+
+			// Matches may not reach into str, so the closest candidates are cut short.
+			// Those cannot improve the result and do not count against the chain depth.
+			if (max > best_length)
+			{
+				if (!chain--)
+					break;
+
+				// cheap reject: a better match has to extend beyond best_length
+				if (pos[best_length] == str[best_length])
+				{
+					uint8_t length = (uint8_t)simd::match_length(pos, str, max);
+					if (length > best_length)
+					{
+						best_length = length;
+						best_match = pos;
+						if (length == len) // cannot get better
+							break;
+					}
+				}
+			}
+
+			uint32_t next = _prev[cand & PREV_MASK];
+			if (next >= cand) // end of chain or overwritten slot
+				break;
+			cand = next;
+		}
+
+		if (best_length < MIN_LENGTH)
+			return { nullptr, 0 };
+		return { best_match, best_length };
+	}
+
+	void add(const uint8_t*) {} // positions are inserted lazily by find_best_match
 };
\ No newline at end of file
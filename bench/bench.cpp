@@ -0,0 +1,583 @@
+// Codec benchmark: runs the ZLC levels, the match finders and RLE over a reproducible synthetic
+// corpus (and any directories given on the command line), round trip verifies every result and
+// reports MB/s, ratio, allocations and peak heap usage as a table and optionally as JSON.
+// Exits with 1 if a round trip fails, so it can be used as a gate when the encoders change.
+#include <map>
+#include <span>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <memory>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include <filesystem>
+
+#include <new>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+
+#include "ZLC.hpp"
+#include "RLE.hpp"
+#include "ZlcDict.hpp"
+
+namespace fs = std::filesystem;
+typedef std::chrono::steady_clock bench_clock;
+
+// heap statistics of the whole process, every allocation carries its size in front
+struct HeapStats
+{
+	std::atomic<size_t> allocations = 0;
+	std::atomic<size_t> live = 0;
+	std::atomic<size_t> peak = 0;
+};
+
+static HeapStats heap;
+static constexpr size_t ALLOC_HEADER = alignof(std::max_align_t);
+
+void* operator new(size_t size)
+{
+	uint8_t* p = (uint8_t*)std::malloc(size + ALLOC_HEADER);
+	if (!p)
+		throw std::bad_alloc();
+	*(size_t*)p = size;
+	heap.allocations++;
+	size_t live = heap.live += size;
+	size_t peak = heap.peak;
+	while (live > peak && !heap.peak.compare_exchange_weak(peak, live));
+	return p + ALLOC_HEADER;
+}
+
+void operator delete(void* p) noexcept
+{
+	if (!p)
+		return;
+	uint8_t* block = (uint8_t*)p - ALLOC_HEADER;
+	heap.live -= *(size_t*)block;
+	std::free(block);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	operator delete(p);
+}
+
+// Allocations and peak heap growth from construction on.
+class HeapScope
+{
+	size_t _allocations;
+	size_t _live;
+
+public:
+	HeapScope() :
+		_allocations(heap.allocations),
+		_live(heap.live)
+	{
+		heap.peak = _live;
+	}
+
+	size_t allocations() const { return heap.allocations - _allocations; }
+	size_t peak() const { return heap.peak - _live; }
+};
+
+// xorshift64*, the std distributions differ between standard libraries
+class Random
+{
+	uint64_t _state;
+
+public:
+	Random(uint64_t seed) :
+		_state(seed)
+	{
+	}
+
+	uint64_t next()
+	{
+		_state ^= _state >> 12;
+		_state ^= _state << 25;
+		_state ^= _state >> 27;
+		return _state * 0x2545F4914F6CDD1Dull;
+	}
+
+	// 0 .. n-1
+	uint32_t below(uint32_t n)
+	{
+		return (uint32_t)(((next() >> 32) * n) >> 32);
+	}
+};
+
+struct Corpus
+{
+	std::string name;
+	std::vector<std::vector<uint8_t>> files;
+
+	size_t size() const
+	{
+		size_t total = 0;
+		for (auto& f : files)
+			total += f.size();
+		return total;
+	}
+};
+
+// CG-like RGBA image: gradients, flat shapes with soft edges and a bit of dithering noise
+Corpus make_image(size_t size)
+{
+	const size_t width = 512;
+	const size_t height = std::max<size_t>(size / (width * 4), 1);
+	Random rnd(1);
+	std::vector<uint8_t> img(width * height * 4);
+
+	struct Shape { int x, y, r; uint8_t color[3]; };
+	std::vector<Shape> shapes(24);
+	for (auto& s : shapes)
+	{
+		s.x = rnd.below(width);
+		s.y = rnd.below((uint32_t)height);
+		s.r = 8 + rnd.below(64);
+		for (auto& c : s.color)
+			c = (uint8_t)rnd.below(256);
+	}
+
+	for (size_t y = 0; y < height; y++)
+	{
+		for (size_t x = 0; x < width; x++)
+		{
+			uint8_t* px = &img[(y * width + x) * 4];
+			px[0] = (uint8_t)(x * 255 / width);
+			px[1] = (uint8_t)(y * 255 / height);
+			px[2] = (uint8_t)((x + y) / 4);
+			px[3] = 255;
+			for (auto& s : shapes)
+			{
+				int dx = (int)x - s.x, dy = (int)y - s.y;
+				int d2 = dx * dx + dy * dy;
+				if (d2 > s.r * s.r)
+					continue;
+				// soft edge over the outer 2 pixels
+				int edge = std::min(255, (s.r * s.r - d2) * 64);
+				for (int c = 0; c < 3; c++)
+					px[c] = (uint8_t)((px[c] * (255 - edge) + s.color[c] * edge) / 255);
+			}
+			if (x % 64 < 16) // dithered stripe
+			{
+				for (int c = 0; c < 3; c++)
+					px[c] = (uint8_t)std::clamp(px[c] + (int)rnd.below(5) - 2, 0, 255);
+			}
+		}
+	}
+	return { "image", { std::move(img) } };
+}
+
+// scenario scripts: dialogue lines and commands, split into files of 4 to 32 KiB
+Corpus make_scripts(size_t size)
+{
+	static const char* syllables[] = {
+		"ka", "ki", "ku", "ke", "ko", "sa", "shi", "su", "se", "so", "ta", "chi", "tsu", "te", "to",
+		"na", "ni", "nu", "ne", "no", "ha", "hi", "fu", "he", "ho", "ma", "mi", "mu", "me", "mo",
+		"ya", "yu", "yo", "ra", "ri", "ru", "re", "ro", "wa", "n", "the", "and", "you", "what",
+	};
+	static const char* names[] = { "Kotone", "Nagisa", "Sakura", "Yuu", "Teacher", "???" };
+	constexpr size_t syllable_count = sizeof(syllables) / sizeof(syllables[0]);
+	constexpr size_t name_count = sizeof(names) / sizeof(names[0]);
+
+	Random rnd(2);
+	std::vector<std::string> words(300);
+	for (auto& w : words)
+	{
+		size_t n = 1 + rnd.below(3);
+		for (size_t i = 0; i < n; i++)
+			w += syllables[rnd.below(syllable_count)];
+	}
+
+	Corpus corpus{ "scripts", {} };
+	size_t total = 0;
+	while (total < size)
+	{
+		size_t target = std::min<size_t>(4096 + rnd.below(28 * 1024), size - total);
+		std::string text;
+		while (text.size() < target)
+		{
+			switch (rnd.below(8))
+			{
+			case 0:
+				text += "@bg storage=bg" + std::to_string(rnd.below(40)) + " time=" + std::to_string(rnd.below(10) * 100) + "\r\n";
+				break;
+			case 1:
+				text += "@se storage=se" + std::to_string(rnd.below(100)) + "\r\n";
+				break;
+			default:
+				text += std::string("[") + names[rnd.below(name_count)] + "]\r\n\"";
+				for (size_t n = 4 + rnd.below(12); n; n--)
+				{
+					// common words are far more likely
+					size_t r = rnd.below((uint32_t)words.size());
+					text += words[r * r / words.size()];
+					text += n > 1 ? ' ' : '.';
+				}
+				text += "\"\r\n";
+				break;
+			}
+		}
+		text.resize(target);
+		corpus.files.emplace_back(text.begin(), text.end());
+		total += target;
+	}
+	return corpus;
+}
+
+// 16 bit stereo PCM: a few drifting tones plus noise, hard to compress like real recordings
+Corpus make_audio(size_t size)
+{
+	Random rnd(3);
+	const size_t frames = std::max<size_t>(size / 4, 1);
+	std::vector<uint8_t> pcm(frames * 4);
+	double phase[3] = {};
+	for (size_t i = 0; i < frames; i++)
+	{
+		double t = i / 44100.0;
+		double freqs[3] = { 220 + 30 * std::sin(t * 0.5), 330 + 20 * std::sin(t * 0.3), 880 };
+		double v = 0;
+		for (int k = 0; k < 3; k++)
+		{
+			phase[k] += 2 * 3.14159265358979 * freqs[k] / 44100.0;
+			v += std::sin(phase[k]) * (6000 >> k);
+		}
+		for (int ch = 0; ch < 2; ch++)
+		{
+			int16_t s = (int16_t)std::clamp<int>((int)v + (int)rnd.below(512) - 256, -32768, 32767);
+			pcm[i * 4 + ch * 2] = (uint8_t)s;
+			pcm[i * 4 + ch * 2 + 1] = (uint8_t)(s >> 8);
+		}
+	}
+	return { "audio", { std::move(pcm) } };
+}
+
+// zero runs, short repeated patterns and table records with a counter
+Corpus make_repetitive(size_t size)
+{
+	Random rnd(4);
+	std::vector<uint8_t> data;
+	data.reserve(size);
+	uint32_t counter = 0;
+	while (data.size() < size)
+	{
+		switch (rnd.below(3))
+		{
+		case 0:
+			data.insert(data.end(), 64 + rnd.below(4096), 0);
+			break;
+		case 1:
+		{
+			uint8_t pattern[3] = { (uint8_t)rnd.below(256), (uint8_t)rnd.below(256), (uint8_t)rnd.below(256) };
+			size_t width = 1 + rnd.below(3);
+			for (size_t n = 16 + rnd.below(1024); n; n--)
+				data.push_back(pattern[n % width]);
+			break;
+		}
+		default:
+			for (size_t n = 8 + rnd.below(64); n; n--)
+			{
+				uint8_t record[32] = { 'R', 'E', 'C', 0 };
+				std::memcpy(record + 4, &counter, sizeof(counter));
+				record[8] = (uint8_t)rnd.below(4);
+				counter++;
+				data.insert(data.end(), record, record + sizeof(record));
+			}
+			break;
+		}
+	}
+	data.resize(size);
+	return { "repetitive", { std::move(data) } };
+}
+
+Corpus load_directory(const fs::path& dir)
+{
+	Corpus corpus{ dir.filename().string(), {} };
+	if (corpus.name.empty())
+		corpus.name = dir.string();
+	std::vector<fs::path> paths;
+	for (auto& entry : fs::recursive_directory_iterator(dir))
+	{
+		if (entry.is_regular_file())
+			paths.push_back(entry.path());
+	}
+	std::sort(paths.begin(), paths.end());
+	for (auto& path : paths)
+	{
+		std::ifstream fin(path, std::ios::binary);
+		corpus.files.emplace_back(std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>());
+	}
+	return corpus;
+}
+
+struct Codec
+{
+	std::string name;
+	std::function<std::vector<uint8_t>(const std::vector<uint8_t>&)> compress;
+	std::function<void(std::span<const uint8_t>, std::vector<uint8_t>&)> decompress;
+};
+
+std::vector<Codec> make_codecs(const std::vector<int>& levels)
+{
+	auto zlc_decompress = [](std::span<const uint8_t> in, std::vector<uint8_t>& out) { zlc::decompress(in, out); };
+	std::vector<Codec> codecs;
+	for (int level : levels)
+	{
+		// one workspace for all files, like a worker thread of the packer
+		auto ws = std::make_shared<zlc::workspace>();
+		codecs.push_back({ "zlc-" + std::to_string(level),
+			[ws, level](const std::vector<uint8_t>& in) { return zlc::compress(in, level, *ws); }, zlc_decompress });
+	}
+	// the greedy parser with each match finder
+	codecs.push_back({ "zlc-search", [](const std::vector<uint8_t>& in) { return zlc::compress<ZlcSearch>(in); }, zlc_decompress });
+	codecs.push_back({ "zlc-dict", [](const std::vector<uint8_t>& in) { return zlc::compress<ZlcDict>(in); }, zlc_decompress });
+	codecs.push_back({ "zlc-chain", [](const std::vector<uint8_t>& in) { return zlc::compress<ZlcHashChain>(in); }, zlc_decompress });
+	codecs.push_back({ "rle", [](const std::vector<uint8_t>& in) { return rle::compress(in); },
+		[](std::span<const uint8_t> in, std::vector<uint8_t>& out) { rle::decompress(in, out); } });
+	return codecs;
+}
+
+struct Result
+{
+	std::string corpus;
+	std::string codec;
+	size_t input_size = 0;
+	size_t output_size = 0;
+	double compress_seconds = 0; // fastest run
+	double decompress_seconds = 0;
+	size_t allocations = 0; // compression and decompression, last run
+	size_t peak = 0; // heap growth, last run
+	bool verified = true;
+
+	double ratio() const { return input_size ? (double)output_size / input_size : 1.0; }
+	double compress_mbps() const { return compress_seconds > 0 ? input_size / 1e6 / compress_seconds : 0; }
+	double decompress_mbps() const { return decompress_seconds > 0 ? input_size / 1e6 / decompress_seconds : 0; }
+};
+
+Result run(const Corpus& corpus, const Codec& codec, int runs)
+{
+	Result r;
+	r.corpus = corpus.name;
+	r.codec = codec.name;
+	r.input_size = corpus.size();
+	r.compress_seconds = r.decompress_seconds = INFINITY;
+
+	std::vector<std::vector<uint8_t>> outputs(corpus.files.size());
+	std::vector<uint8_t> decoded;
+	for (int i = 0; i < runs; i++)
+	{
+		HeapScope scope;
+		auto t0 = bench_clock::now();
+		for (size_t f = 0; f < corpus.files.size(); f++)
+			outputs[f] = codec.compress(corpus.files[f]);
+		auto t1 = bench_clock::now();
+		for (auto& out : outputs)
+			codec.decompress(out, decoded);
+		auto t2 = bench_clock::now();
+
+		r.compress_seconds = std::min(r.compress_seconds, std::chrono::duration<double>(t1 - t0).count());
+		r.decompress_seconds = std::min(r.decompress_seconds, std::chrono::duration<double>(t2 - t1).count());
+		r.allocations = scope.allocations();
+		r.peak = scope.peak();
+	}
+
+	// checked outside of the timed loop
+	r.output_size = 0;
+	for (size_t f = 0; f < corpus.files.size(); f++)
+	{
+		r.output_size += outputs[f].size();
+		try
+		{
+			codec.decompress(outputs[f], decoded);
+			if (decoded != corpus.files[f])
+				r.verified = false;
+		}
+		catch (const std::exception&)
+		{
+			r.verified = false;
+		}
+	}
+	return r;
+}
+
+void print_table(const std::vector<Result>& results)
+{
+	printf("%-12s %-11s %10s %8s %10s %10s %8s %10s  %s\n",
+		"corpus", "codec", "size KiB", "ratio", "comp MB/s", "dec MB/s", "allocs", "peak KiB", "check");
+	for (auto& r : results)
+	{
+		printf("%-12s %-11s %10.1f %7.2f%% %10.1f %10.1f %8zu %10.1f  %s\n",
+			r.corpus.c_str(), r.codec.c_str(), r.input_size / 1024.0, r.ratio() * 100,
+			r.compress_mbps(), r.decompress_mbps(), r.allocations, r.peak / 1024.0, r.verified ? "ok" : "FAILED");
+	}
+}
+
+std::string json_escape(const std::string& s)
+{
+	std::string out;
+	for (char c : s)
+	{
+		if (c == '"' || c == '\\')
+			out += '\\';
+		if ((unsigned char)c < 0x20)
+		{
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			out += buf;
+		}
+		else out += c;
+	}
+	return out;
+}
+
+void write_json(std::ostream& out, const std::vector<Result>& results, int runs)
+{
+	out << "{\n  \"runs\": " << runs << ",\n  \"results\": [";
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		auto& r = results[i];
+		char numbers[512];
+		snprintf(numbers, sizeof(numbers),
+			"\"input_bytes\": %zu, \"output_bytes\": %zu, \"ratio\": %.6f, "
+			"\"compress_mbps\": %.3f, \"decompress_mbps\": %.3f, \"allocations\": %zu, \"peak_bytes\": %zu",
+			r.input_size, r.output_size, r.ratio(), r.compress_mbps(), r.decompress_mbps(), r.allocations, r.peak);
+		out << (i ? "," : "") << "\n    { \"corpus\": \"" << json_escape(r.corpus) << "\", \"codec\": \"" << json_escape(r.codec)
+			<< "\", " << numbers << ", \"verified\": " << (r.verified ? "true" : "false") << " }";
+	}
+	out << "\n  ]\n}\n";
+}
+
+void print_usage()
+{
+	std::cout << "Usage: bench [options] [directories...]\n"
+		"Runs every codec over the synthetic corpus and the given directories.\n\n"
+		"Options:\n"
+		"  -r, --runs <n>      timed runs per codec, the fastest counts (default: 3)\n"
+		"  -l, --levels <l,..> ZLC levels to run (default: 1,5,9)\n"
+		"  -c, --codec <name>  only run this codec, can be repeated (e.g. zlc-5, zlc-dict, rle)\n"
+		"  -s, --size <KiB>    size of each synthetic corpus (default: 1024)\n"
+		"  -n, --no-synthetic  skip the synthetic corpus\n"
+		"  -j, --json <path>   also write the results as JSON, - for stdout\n"
+		"  -h, --help          show this help message and exit\n";
+}
+
+int main(int argc, const char** argv)
+{
+	int runs = 3;
+	std::vector<int> levels = { 1, 5, 9 };
+	std::vector<std::string> only;
+	size_t size = 1024 * 1024;
+	bool synthetic = true;
+	std::string json;
+	std::vector<fs::path> dirs;
+
+	try
+	{
+		for (int i = 1; i < argc; i++)
+		{
+			std::string arg = argv[i];
+			auto value = [&]() -> std::string {
+				if (i + 1 >= argc)
+					throw std::runtime_error("Missing value for " + arg);
+				return argv[++i];
+			};
+			if (arg == "-r" || arg == "--runs")
+				runs = std::max(1, std::stoi(value()));
+			else if (arg == "-l" || arg == "--levels")
+			{
+				levels.clear();
+				std::string list = value();
+				for (size_t pos = 0; pos < list.size();)
+				{
+					size_t end = std::min(list.find(',', pos), list.size());
+					levels.push_back(std::stoi(list.substr(pos, end - pos)));
+					pos = end + 1;
+				}
+			}
+			else if (arg == "-c" || arg == "--codec")
+				only.push_back(value());
+			else if (arg == "-s" || arg == "--size")
+				size = std::stoull(value()) * 1024;
+			else if (arg == "-n" || arg == "--no-synthetic")
+				synthetic = false;
+			else if (arg == "-j" || arg == "--json")
+				json = value();
+			else if (arg == "-h" || arg == "--help")
+			{
+				print_usage();
+				return 0;
+			}
+			else if (arg.starts_with("-"))
+				throw std::runtime_error("Invalid argument: " + arg);
+			else dirs.emplace_back(arg);
+		}
+		for (int level : levels)
+		{
+			if (level < zlc::MIN_LEVEL || level > zlc::MAX_LEVEL)
+				throw std::runtime_error("Invalid ZLC level: " + std::to_string(level));
+		}
+	}
+	catch (const std::exception& exc)
+	{
+		std::cerr << exc.what() << "\n\n";
+		print_usage();
+		return 2;
+	}
+
+	std::vector<Corpus> corpora;
+	if (synthetic)
+	{
+		corpora.push_back(make_image(size));
+		corpora.push_back(make_scripts(size));
+		corpora.push_back(make_audio(size));
+		corpora.push_back(make_repetitive(size));
+	}
+	for (auto& dir : dirs)
+		corpora.push_back(load_directory(dir));
+
+	auto codecs = make_codecs(levels);
+	if (!only.empty())
+	{
+		std::erase_if(codecs, [&](const Codec& c) { return std::find(only.begin(), only.end(), c.name) == only.end(); });
+		if (codecs.empty())
+		{
+			std::cerr << "None of the given codecs exist.\n";
+			return 2;
+		}
+	}
+
+	std::vector<Result> results;
+	bool ok = true;
+	for (auto& corpus : corpora)
+	{
+		for (auto& codec : codecs)
+		{
+			results.push_back(run(corpus, codec, runs));
+			ok &= results.back().verified;
+		}
+	}
+
+	if (json == "-")
+		write_json(std::cout, results, runs);
+	else
+	{
+		print_table(results);
+		if (!json.empty())
+		{
+			std::ofstream fout(json);
+			write_json(fout, results, runs);
+		}
+	}
+
+	if (!ok)
+	{
+		std::cerr << "Round trip verification FAILED.\n";
+		return 1;
+	}
+	return 0;
+}
\ No newline at end of file
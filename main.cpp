@@ -6,13 +6,40 @@
 #include <map>
 #include <filesystem>
 #include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <span>
+#include <optional>
+#include <string_view>
+#include <cstdio>
+#include <new>
 
 #include <cstdint>
+#include <cstdlib>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <Windows.h>
+#include <Psapi.h>
+#else
+#include <sys/resource.h>
+#endif
 
 #include "Options.hpp"
 #include "RLE.hpp"
 #include "ZLC.hpp"
 #include "MultithreadCompressor.hpp"
+#include "Fpk.hpp"
+#include "FpkReader.hpp"
+#include "CompressionCache.hpp"
+#include "FileLoader.hpp"
+#include "OutputDirectory.hpp"
+#include "StorePolicy.hpp"
 
 namespace fs = std::filesystem;
 namespace ch = std::chrono;
@@ -20,42 +47,50 @@ namespace ch = std::chrono;
 
 Options options;
 
+// every allocation of the process, shown in the verbose statistics
+std::atomic<size_t> allocation_count = 0;
 
-typedef std::pair<uint32_t, fs::path> file_info_t;
-
-constexpr size_t MAX_MEMORY_USAGE = 1 << 31;
-
-struct FpkTRL
+// All the replaced operators go through these two, so the compiler sees malloc and free
+// pair up wherever they are inlined. Aligned new is not used, its defaults are left alone.
+static void* counted_malloc(size_t size)
 {
-	uint32_t key, toc_offset;
-};
+	allocation_count.fetch_add(1, std::memory_order_relaxed);
+	if (void* p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
 
-template <size_t S>
-struct FpkEntry1
+static void counted_free(void* p) noexcept
 {
-	uint32_t offset, length;
-	char filename[S];
-	uint32_t hash;
+	std::free(p);
+}
 
-	FpkEntry1() = default;
+void* operator new(size_t size) { return counted_malloc(size); }
+void* operator new[](size_t size) { return counted_malloc(size); }
+void operator delete(void* p) noexcept { counted_free(p); }
+void operator delete[](void* p) noexcept { counted_free(p); }
+void operator delete(void* p, size_t) noexcept { counted_free(p); }
+void operator delete[](void* p, size_t) noexcept { counted_free(p); }
 
-	FpkEntry1(uint32_t offs, uint32_t len, const std::string& fn, uint32_t hash) :
-		offset(offs), length(len), hash(hash)
-	{
-		std::memset(filename, 0, sizeof(filename));
-		std::strncpy(filename, fn.c_str(), sizeof(filename) - 1);
-	}
-};
+size_t peak_rss()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return counters.PeakWorkingSetSize;
+	return 0;
+#else
+	rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+	return (size_t)usage.ru_maxrss * 1024; // KiB
+#endif
+}
 
-typedef FpkEntry1<24> FpkV2Entry;
-typedef FpkEntry1<128> FpkV3Entry;
-typedef FpkEntry1<260> FpkV4Entry;
 
-struct FpkEntry2
-{
-	uint32_t offset, length;
-	char filename[24];
-};
+typedef std::pair<uint32_t, fs::path> file_info_t;
+
+constexpr int EXTRACT_WRITER_THREADS = 2;
 
 std::string str_tolower(std::string s) {
 	std::transform(s.begin(), s.end(), s.begin(),
@@ -63,6 +98,33 @@ std::string str_tolower(std::string s) {
 	);
 	return s;
 }
+// Parses a byte count with an optional K, M or G suffix (powers of 1024).
+size_t parse_size(const std::string& arg)
+{
+	size_t end;
+	unsigned long long value = std::stoull(arg, &end);
+	std::string suffix = str_tolower(arg.substr(end));
+	if (suffix.ends_with("ib"))
+		suffix.erase(suffix.size() - 2);
+	else if (suffix.size() > 1 && suffix.ends_with('b'))
+		suffix.pop_back();
+
+	int shift;
+	if (suffix.empty() || suffix == "b")
+		shift = 0;
+	else if (suffix == "k")
+		shift = 10;
+	else if (suffix == "m")
+		shift = 20;
+	else if (suffix == "g")
+		shift = 30;
+	else
+		throw std::invalid_argument("Unknown size suffix: " + suffix);
+	if (value > (std::numeric_limits<size_t>::max() >> shift))
+		throw std::out_of_range("Size too large: " + arg);
+	return (size_t)value << shift;
+}
+
 inline const char* bool_to_str(bool b)
 {
 	return b ? "true" : "false";
@@ -124,116 +186,513 @@ void write(std::ofstream& f, const std::vector<T>& v)
 	f.write((const char*)v.data(), v.size() * sizeof(T));
 }
 
-template<typename T>
-void obfuscate(std::vector<T>& data, uint32_t key)
+void print_cache_stats(const CompressionCache& cache)
 {
-	uint32_t* pos = (uint32_t*)data.data();
-	uint32_t* end = (uint32_t*)((size_t)pos + data.size() * sizeof(T));
-	while (pos < end)
-		*pos++ ^= key;
+	std::cout << "Compression cache: " << cache.hits() << " hits, " << cache.misses() << " misses\n";
 }
 
-template <typename T>
-void extract_toc(std::istream& fin, const std::vector<T>& toc, const fs::path& outpath, uint32_t entry_count)
+void print_memory_usage(MultithreadCompressor<zlc>& compressor)
 {
-	std::ofstream fout;
-	fout.exceptions(std::ios::failbit | std::ios::badbit);
-	for (auto& entry : toc)
+	printf("Peak memory usage: %.1f MiB of %.1f MiB\n",
+		compressor.peak_memory_usage() / 1048576.0, compressor.memory_limit() / 1048576.0);
+}
+
+void print_buffer_stats(const BufferPool& buffers)
+{
+	printf("Buffers: %zu allocated, %zu reused\n", buffers.allocated(), buffers.reused());
+}
+
+void print_process_stats()
+{
+	printf("Peak RSS: %.1f MiB, %zu allocations\n", peak_rss() / 1048576.0, allocation_count.load());
+}
+
+void print_read_throughput(const FileLoader& loader)
+{
+	// the time the loader waited for the compressor does not count
+	printf("Read %zu files (%.1f MiB) in %.2f s, %.1f MiB/s via %s, %.2f s waiting for the compressor\n",
+		loader.files(), loader.bytes() / 1048576.0, loader.read_seconds(),
+		loader.read_seconds() > 0 ? loader.bytes() / 1048576.0 / loader.read_seconds() : 0.0,
+		loader.engine_name(), loader.seconds() - loader.read_seconds());
+}
+
+void print_write_throughput(const OutputDirectory& out)
+{
+	const double seconds = std::max(out.seconds(), 1e-9);
+	printf("Wrote %zu files (%.1f MiB) in %.2f s, %.0f files/s, %.1f MiB/s\n",
+		out.files(), out.bytes() / 1048576.0, out.seconds(), out.files() / seconds, out.bytes() / 1048576.0 / seconds);
+}
+
+void print_store_stats(const StorePolicy::Stats& stats)
+{
+	printf("Stored %zu of %zu compressed files raw (%.1f MiB)\n",
+		stats.stored_files(), stats.files(), stats.stored_bytes() / 1048576.0);
+}
+
+void compression_started_callback(const std::pair<std::string, std::vector<uint8_t>>& task)
+{
+	std::cout << task.first + '\n';
+}
+
+// Entries that do not fit into the memory budget are decoded piece by piece instead.
+bool needs_streaming(const FpkReader& reader, const FpkReader::Entry& entry)
+{
+	return MultithreadCompressor<zlc>::decompress_cost(reader.payload(entry)) > options.max_memory;
+}
+
+void stream_entry(const FpkReader& reader, const FpkReader::Entry& entry, OutputDirectory& out)
+{
+	if (options.verbose)
+		std::cout << entry.name + " (streamed)\n";
+	auto file = out.create(entry.name, peek_payload(reader.payload(entry)).original_size);
+	reader.stream_entry(entry, [&](std::span<const uint8_t> piece) {
+		file.write(piece);
+	});
+	file.close();
+}
+
+void extract_entries_async(const FpkReader& reader, OutputDirectory& out)
+{
+	// payload and output buffers are recycled, a small part of the budget
+	BufferPool buffers(std::min<size_t>(options.max_memory / 8, 64 << 20));
+	MultithreadCompressor<zlc> decompressor(options.threads, options.max_memory);
+	decompressor.buffers(&buffers);
+	if (options.verbose)
+		decompressor.task_started_callack(compression_started_callback);
+	decompressor.start(MultithreadCompressor<zlc>::Mode::decompress);
+
+	// read the payloads in file order instead of TOC (hash) order
+	std::vector<const FpkReader::Entry*> schedule, streamed;
+	schedule.reserve(reader.entries().size());
+	for (auto entry : reader.read_order())
+		(needs_streaming(reader, *entry) ? streamed : schedule).push_back(entry);
+
+	std::atomic<bool> failed = false;
+	std::exception_ptr error;
+	std::mutex error_mutex;
+	auto fail = [&]() {
+		std::lock_guard lock(error_mutex);
+		if (!error)
+			error = std::current_exception();
+		failed = true;
+		decompressor.stop(); // wakes up the loader and the writers
+	};
+
+	std::thread loader([&]() {
+		try
+		{
+			FpkReader::Readahead readahead(reader, schedule);
+			for (size_t i = 0; i < schedule.size(); i++)
+			{
+				const FpkReader::Entry* entry = schedule[i];
+				readahead.advance(i);
+				auto payload = reader.payload(*entry);
+				size_t cost = decompressor.decompress_cost(payload);
+				if (!decompressor.acquire_memory(cost) || failed)
+					return;
+				auto data = buffers.take(payload.size());
+				std::copy(payload.begin(), payload.end(), data.begin());
+				decompressor.emplace(std::make_pair(entry->name, std::move(data)), cost);
+			}
+		}
+		catch (...)
+		{
+			fail();
+		}
+	});
+
+	std::atomic<size_t> files_claimed = 0;
+	std::vector<std::thread> writers(std::min(EXTRACT_WRITER_THREADS, (int)schedule.size()));
+	for (auto& writer : writers)
 	{
-		fin.seekg(entry.offset);
-		auto data = read<uint8_t>(fin, entry.length);
+		writer = std::thread([&]() {
+			try
+			{
+				while (!failed && files_claimed++ < schedule.size())
+				{
+					auto result = decompressor.pop();
+					out.write(result.first, result.second);
+					buffers.give(std::move(result.second));
+				}
+			}
+			catch (...)
+			{
+				fail();
+			}
+		});
+	}
+
+	loader.join();
+	for (auto& writer : writers)
+		writer.join();
+	decompressor.stop_wait();
+
+	if (error)
+		std::rethrow_exception(error);
+
+	// one after another, after the parallel part gave its memory back
+	for (auto entry : streamed)
+		stream_entry(reader, *entry, out);
+
+	if (options.verbose)
+	{
+		print_memory_usage(decompressor);
+		print_buffer_stats(buffers);
+	}
+}
 
+void extract_entries(const FpkReader& reader, OutputDirectory& out)
+{
+	if (options.threads != 1)
+	{
+		extract_entries_async(reader, out);
+		return;
+	}
+
+	auto order = reader.read_order();
+	FpkReader::Readahead readahead(reader, order);
+	std::vector<uint8_t> buffer, scratch;
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		const FpkReader::Entry& entry = *order[i];
+		readahead.advance(i);
+		if (needs_streaming(reader, entry))
+		{
+			stream_entry(reader, entry, out);
+			continue;
+		}
 		if (options.verbose)
-			std::cout << entry.filename << '\n';
+			std::cout << entry.name << '\n';
+
+		// stored entries are written straight from the mapping
+		auto data = reader.read_entry(entry, buffer, scratch);
+		out.write(entry.name, data);
+	}
+}
 
-		data = rle::decompress(data);
-		data = zlc::decompress(data);
+void extract_selected(const FpkReader& reader, OutputDirectory& out, const std::vector<std::string>& names)
+{
+	// resolve everything first so a typo does not leave a half extracted directory
+	std::vector<const FpkReader::Entry*> selected;
+	for (auto& name : names)
+	{
+		auto entry = reader.find(name);
+		if (!entry)
+			throw std::runtime_error("Entry not found in the archive: " + name);
+		selected.push_back(entry);
+	}
+	std::sort(selected.begin(), selected.end(), [](auto a, auto b) { return a->offset < b->offset; });
 
-		fout.open(outpath / entry.filename, std::ios::binary);
-		fout.write((char*)data.data(), data.size());
-		fout.close();
+	FpkReader::Readahead readahead(reader, selected);
+	std::vector<uint8_t> buffer, scratch;
+	for (size_t i = 0; i < selected.size(); i++)
+	{
+		const FpkReader::Entry* entry = selected[i];
+		readahead.advance(i);
+		if (needs_streaming(reader, *entry))
+		{
+			stream_entry(reader, *entry, out);
+			continue;
+		}
+		if (options.verbose)
+			std::cout << entry->name << '\n';
+
+		auto data = reader.read_entry(*entry, buffer, scratch);
+		out.write(entry->name, data);
 	}
 }
 
-template <typename T>
-void extract_obfuscated(std::istream& fin, const fs::path& outpath, uint32_t entry_count)
+void print_archive_info(const FpkReader& reader, int version)
 {
-	fin.seekg(-(int)sizeof(FpkTRL), std::ios::end);
-	
-	auto trl = read<FpkTRL>(fin);
-	if (options.verbose)
+	std::cout
+		<< "File size: " << reader.file().size() << '\n'
+		<< "File version: " << version << '\n'
+		<< "Entry count: " << reader.header().entry_count << '\n'
+		<< "Obfuscated: " << bool_to_str(reader.header().obfuscated) << '\n';
+	if (reader.header().obfuscated)
 	{
-		std::cout << "Obfuscation key: 0x" << std::right << std::hex << std::setfill('0') << std::setw(8) << trl.key << '\n'
+		std::cout << "Obfuscation key: 0x" << std::right << std::hex << std::setfill('0') << std::setw(8) << reader.trailer().key << '\n'
 			<< std::left << std::dec << std::setfill(' ')
-			<< "TOC offset: " << std::setw(8) << trl.toc_offset << "\n\n";
+			<< "TOC offset: " << std::setw(8) << reader.trailer().toc_offset << '\n';
 	}
-
-	fin.seekg(trl.toc_offset);
-	auto toc = read<T>(fin, entry_count);
-	
-	obfuscate(toc, trl.key);
-	extract_toc(fin, toc, outpath, entry_count);
+	std::cout << '\n';
 }
 
 void extract_fpk(const fs::path& inpath, const fs::path& outpath, int version)
 {
-	std::ifstream fin(inpath, std::ios::binary);
-	fin.exceptions(std::ios::failbit | std::ios::badbit);
-	uint32_t fpk_header = read<uint32_t>(fin);
-	uint32_t flags = fpk_header & 0xF0000000;
-	uint32_t entry_count = fpk_header & 0x0FFFFFFF;
-	uint32_t obfuscated = flags & 0x80000000;
-	
+	FpkReader reader(inpath, version);
 	if (options.verbose)
-	{
-		auto old_pos = fin.tellg();
-		fin.seekg(0, std::ios::end);
-		std::cout
-			<< "File size: " << (size_t)fin.tellg() << '\n'
-			<< "File version: " << version << '\n'
-			<< "Entry count: " << entry_count << '\n'
-			<< "Obfuscated: " << bool_to_str(obfuscated) << '\n';
-		fin.seekg(old_pos);
-	}
+		print_archive_info(reader, version);
 
 	fs::create_directories(outpath);
+	OutputDirectory out(outpath, options.fsync);
 
-	if (obfuscated) 
+	if (options.entries.empty())
+		extract_entries(reader, out);
+	else extract_selected(reader, out, options.entries);
+
+	out.finish();
+	if (options.verbose)
+		print_write_throughput(out);
+}
+
+
+std::string json_escape(const std::string& s)
+{
+	std::string res;
+	res.reserve(s.size());
+	for (unsigned char c : s)
 	{
-		if (version <= 2) {
-			extract_obfuscated<FpkV2Entry>(fin, outpath, entry_count);
+		if (c == '"' || c == '\\') {
+			res += '\\';
+			res += c;
 		}
-		else if (version == 3) {
-			extract_obfuscated<FpkV3Entry>(fin, outpath, entry_count);
+		else if (c < 0x20) {
+			char buf[8];
+			std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+			res += buf;
 		}
-		else if (version == 4) {
-			extract_obfuscated<FpkV4Entry>(fin, outpath, entry_count);
+		else res += c;
+	}
+	return res;
+}
+
+void list_fpk(const fs::path& inpath, const fs::path& outpath, int version)
+{
+	FpkReader reader(inpath, version);
+	if (options.verbose)
+		print_archive_info(reader, version);
+
+	std::ofstream fout;
+	if (!outpath.empty())
+	{
+		fout.exceptions(std::ios::failbit | std::ios::badbit);
+		fout.open(outpath, std::ios::binary);
+	}
+	std::ostream& out = outpath.empty() ? std::cout : fout;
+
+	auto& entries = reader.entries();
+	if (options.list_format == ListFormat::JSON)
+		out << "[\n";
+	else out << "name\toffset\tstored_size\toriginal_size\tcompression\n";
+
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		auto& entry = entries[i];
+		auto info = peek_payload(reader.payload(entry));
+
+		if (options.list_format == ListFormat::JSON)
+		{
+			out << "  {\"name\": \"" << json_escape(entry.name)
+				<< "\", \"offset\": " << entry.offset
+				<< ", \"stored_size\": " << entry.length
+				<< ", \"original_size\": " << info.original_size
+				<< ", \"compression\": \"" << info.compression << "\"}"
+				<< (i + 1 < entries.size() ? ",\n" : "\n");
 		}
-		else {
-			throw std::runtime_error("Unsupported FPK version: " + std::to_string(version));
+		else
+		{
+			out << entry.name << '\t' << entry.offset << '\t' << entry.length << '\t'
+				<< info.original_size << '\t' << info.compression << '\n';
 		}
 	}
-	else 
+
+	if (options.list_format == ListFormat::JSON)
+		out << "]\n";
+	out.flush();
+}
+
+// Decodes every entry on all threads without writing anything and prints the broken ones.
+// Returns false if there were any.
+bool test_fpk(const fs::path& inpath, int version)
+{
+	FpkReader reader(inpath, version);
+	if (options.verbose)
+		print_archive_info(reader, version);
+
+	int threads = options.threads;
+	if (threads == 0)
+		threads = std::thread::hardware_concurrency() ? std::thread::hardware_concurrency() : 4;
+	// every thread gets its share of the budget, larger entries are decoded piece by piece
+	const size_t thread_memory = options.max_memory / threads;
+
+	const auto start = std::chrono::steady_clock::now();
+	auto order = reader.read_order();
+	FpkReader::Readahead readahead(reader, order);
+	std::mutex readahead_mutex;
+	std::vector<FpkReader::Verdict> verdicts(order.size());
+	std::atomic<size_t> next = 0;
+	std::exception_ptr error;
+	std::mutex error_mutex;
+	auto work = [&]() {
+		try
+		{
+			std::vector<uint8_t> buffer, scratch;
+			for (size_t i; (i = next++) < order.size(); )
+			{
+				{
+					std::lock_guard lock(readahead_mutex);
+					readahead.advance(i);
+				}
+				verdicts[i] = reader.verify_entry(*order[i], thread_memory, buffer, scratch);
+			}
+		}
+		catch (...)
+		{
+			std::lock_guard lock(error_mutex);
+			if (!error)
+				error = std::current_exception();
+			next = order.size(); // the others stop too
+		}
+	};
+	std::vector<std::thread> workers(threads - 1);
+	for (auto& worker : workers)
+		worker = std::thread(work);
+	work();
+	for (auto& worker : workers)
+		worker.join();
+	if (error)
+		std::rethrow_exception(error);
+	const double seconds = std::max(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), 1e-9);
+
+	size_t broken = 0, stored = 0;
+	uint64_t decoded = 0;
+	for (size_t i = 0; i < order.size(); i++)
 	{
-		auto toc = read<FpkEntry2>(fin, entry_count);
-		extract_toc(fin, toc, outpath, entry_count);
+		auto& verdict = verdicts[i];
+		decoded += verdict.decoded;
+		stored += verdict.stored;
+		if (!verdict.problem.empty())
+		{
+			std::cout << order[i]->name + ": " + verdict.problem + '\n';
+			broken++;
+		}
+		else if (options.verbose)
+			std::cout << order[i]->name + ": OK\n";
 	}
+	printf("Tested %zu entries (%zu stored, %.1f MiB decoded) in %.2f s with %d thread(s), %.2f GB/s decoded: %s\n",
+		order.size(), stored, decoded / 1048576.0, seconds, threads, decoded / 1e9 / seconds,
+		broken ? (std::to_string(broken) + " broken").c_str() : "all OK");
+	return broken == 0;
 }
 
-uint32_t hash(const std::string& s)
+// Writes the TOC (obfuscated with the key) and the trailer at the current position.
+// Entries with the same hash keep their input order.
+template <typename T>
+void write_toc(std::ofstream& fout, const std::multimap<uint32_t, T>& toc_map)
 {
-	char c;
-	uint16_t res = 0;
-	for (int i = 0; i < s.length();)
+	FpkTRL trl;
+	trl.toc_offset = fout.tellp();
+	trl.key = options.key;
+
+	std::vector<T> toc;
+	toc.reserve(toc_map.size());
+	for (auto& [hash, entry] : toc_map)
+		toc.push_back(entry);
+	obfuscate(toc, trl.key);
+
+	write(fout, toc);
+	write(fout, trl);
+}
+
+// The payload of the base archive entry with the same name and content, if it was packed
+// with the compressions that are requested now.
+std::optional<std::span<const uint8_t>> reusable_payload(const FpkReader* base, const std::string& name, const std::vector<uint8_t>& data)
+{
+	if (!base)
+		return std::nullopt;
+	return base->reusable_payload(name, data, options.zlc, options.rle, options.zlc && options.store != StoreMode::NEVER);
+}
+
+// Files whose compression does not fit into the memory budget are compressed piece by piece instead.
+bool needs_streaming(uint64_t file_size)
+{
+	return MultithreadCompressor<zlc>::compress_cost(file_size) > options.max_memory;
+}
+
+// Compresses a file straight into the archive while it is read, the ZLC2 header gets the size
+// at the end. Not compared with the base, cached or RLE compressed, all of that needs the whole
+// file. Returns the size of the payload.
+uint64_t pack_streamed(const fs::path& path, std::ofstream& fout, zlc::workspace& ws, StorePolicy::Stats& store_stats)
+{
+	std::ifstream fin(path, std::ios::binary);
+	if (!fin.is_open())
+		throw std::runtime_error("Unable to read " + path.string());
+
+	auto read = [&](std::span<uint8_t> piece) {
+		fin.read((char*)piece.data(), piece.size());
+		if (fin.bad())
+			throw std::runtime_error("Unable to read " + path.string());
+		return (size_t)fin.gcount();
+	};
+	auto read_at = [&](uint64_t offset, std::span<uint8_t> piece) {
+		fin.clear();
+		fin.seekg(offset);
+		return read(piece);
+	};
+	auto write = [&](std::span<const uint8_t> piece) {
+		fout.write((const char*)piece.data(), piece.size());
+	};
+	auto copy = [&]() {
+		std::vector<uint8_t> buffer(1 << 20);
+		uint64_t total = 0;
+		for (size_t n = read_at(0, buffer); n; n = read(buffer))
+		{
+			write(std::span<const uint8_t>(buffer.data(), n));
+			total += n;
+		}
+		return total;
+	};
+
+	const uint64_t start = fout.tellp();
+	StorePolicy::Report report;
+	report.input_size = fs::file_size(path);
+	if (!options.zlc || (options.store == StoreMode::AUTO
+		&& !StorePolicy::worth_compressing(report.input_size, read_at, options.level, ws, report)))
 	{
-		c = ::toupper(s[i++]);
-		res += c * i;
+		report.input_size = copy();
 	}
-	return res;
+	else
+	{
+		fin.clear();
+		fin.seekg(0);
+		report.input_size = zlc::compress_stream(read, write, options.level, ws);
+		const uint64_t end = fout.tellp();
+
+		uint8_t head[8];
+		if (options.store != StoreMode::NEVER && end - start >= report.input_size
+			&& StorePolicy::can_store(std::span<const uint8_t>(head, read_at(0, head))))
+		{
+			// overwritten by the raw file, the rest of the stream is cut off when the archive is done
+			fout.seekp(start);
+			report.input_size = copy();
+			report.decision = StorePolicy::Decision::not_smaller;
+		}
+		else
+		{
+			fout.seekp(start);
+			write(zlc::make_header(report.input_size));
+			fout.seekp(end);
+		}
+	}
+	report.output_size = (uint64_t)fout.tellp() - start;
+	store_stats.add(report);
+	if (options.verbose)
+		std::cout << path.filename().string() + ": " + report.str() + " (streamed)\n";
+	return report.output_size;
+}
+
+// A streamed file that ended up stored raw can leave its longer compressed stream at the end.
+void truncate_archive(std::ofstream& fout, const fs::path& outpath)
+{
+	const uint64_t end = fout.tellp();
+	fout.close();
+	if (fs::file_size(outpath) > end)
+		fs::resize_file(outpath, end);
 }
 
 template <typename T>
-void pack_fpk_sync(const std::deque<fs::path>& files, const fs::path& outpath, int version)
+void pack_fpk_sync(const std::deque<fs::path>& files, const fs::path& outpath, int version, const FpkReader* base, CompressionCache* cache)
 {
 	if (options.verbose)
 		std::cout << "Starting single threaded packing...\n";
@@ -250,18 +709,79 @@ void pack_fpk_sync(const std::deque<fs::path>& files, const fs::path& outpath, i
 	uint32_t h;
 	std::string fn;
 	int i = 0;
+	size_t reused = 0;
+	zlc::workspace workspace; // reused for every file
+	StorePolicy::Stats store_stats;
 	for (auto& filepath : files)
 	{
 		fn = filepath.filename().string();
 		if (options.verbose)
 			std::cout << '(' << i << '/' << file_count << ") " << fn << '\n';
 
+		if (needs_streaming(fs::file_size(filepath)))
+		{
+			h = hash(fn);
+			const uint32_t offset = fout.tellp();
+			toc_map.insert(std::make_pair(h, T(offset, pack_streamed(filepath, fout, workspace, store_stats), fn, h)));
+			i++;
+			continue;
+		}
+
 		auto file = load_file(filepath);
 		
-		if (options.zlc)
-			file = zlc::compress<ZlcDict>(file);
-		//if (options.rle)
-		//	file = rle::compress(file);
+		if (auto payload = reusable_payload(base, fn, file))
+		{
+			file.assign(payload->begin(), payload->end());
+			reused++;
+		}
+		else
+		{
+			std::optional<CompressionCache::Key> key;
+			std::optional<std::vector<uint8_t>> cached;
+			if (cache)
+			{
+				key = CompressionCache::key(file);
+				cached = cache->get(*key);
+			}
+
+			StorePolicy::Report report;
+			report.input_size = file.size();
+			if (cached)
+			{
+				file = std::move(*cached);
+				report.decision = options.zlc ? StorePolicy::cached_decision(file) : StorePolicy::Decision::cached;
+			}
+			else if (options.zlc && options.store == StoreMode::AUTO
+				&& !StorePolicy::worth_compressing(file, options.level, workspace, report))
+			{
+				// stored as it is, not cached since the estimate is cheap
+			}
+			else
+			{
+				std::vector<uint8_t> input;
+				if (options.zlc)
+				{
+					input = std::move(file);
+					file = zlc::compress(input, options.level, workspace);
+					workspace.trim();
+				}
+				if (options.rle)
+				{
+					// outer layer, the extractor decodes RLE0 before ZLC2
+					auto packed = rle::compress(file);
+					if (packed.size() < file.size())
+						file = std::move(packed);
+				}
+				if (options.zlc && options.store != StoreMode::NEVER)
+					StorePolicy::store_if_not_smaller(file, input, report);
+				if (cache)
+					cache->put(*key, file);
+			}
+			report.output_size = file.size();
+			store_stats.add(report);
+			if (options.verbose)
+				std::cout << fn + ": " + report.str() + '\n';
+		}
 
 		h = hash(fn);
 		toc_map.insert(std::make_pair(h, T(fout.tellp(), file.size(), fn, h)));
@@ -271,35 +791,64 @@ void pack_fpk_sync(const std::deque<fs::path>& files, const fs::path& outpath, i
 		i++;
 	}
 
-	FpkTRL trl;
-	trl.toc_offset = fout.tellp();
-	trl.key = 0; // TODO: custom key
-	
-	for (auto& [hash, entry] : toc_map)
-		write(fout, entry);
-
-	write(fout, trl);
-}
-
-void compression_started_callback(const std::pair<std::string, std::vector<uint8_t>>& task)
-{
-	std::cout << task.first + '\n';
+	write_toc(fout, toc_map);
+	truncate_archive(fout, outpath);
+	if (base && options.verbose)
+		std::cout << "Reused " << reused << " of " << file_count << " payloads from the base archive.\n";
+	if (cache && options.verbose)
+		print_cache_stats(*cache);
+	if (options.verbose)
+		print_store_stats(store_stats);
 }
 
 void file_loader(
-	const std::deque<fs::path>& files,
-	MultithreadCompressor<zlc>& compressor)
+	FileLoader& loader,
+	const std::vector<fs::path>& files,
+	BufferPool& buffers,
+	MultithreadCompressor<zlc>& compressor,
+	const FpkReader* base,
+	std::vector<uint8_t>& streamed,
+	size_t& reused,
+	std::exception_ptr& error)
 {
-	for (auto& filepath : files)
+	try
+	{
+		// reserve before loading, so the raw input is part of the budget too
+		auto admit = [&](uint64_t size, bool wait) {
+			size_t cost = compressor.compress_cost(size);
+			return wait ? compressor.acquire_memory(cost) : compressor.try_acquire_memory(cost);
+		};
+		auto deliver = [&](FileLoader::File&& file) {
+			size_t cost = compressor.compress_cost(file.size);
+			auto name = files[file.index].filename().string();
+			if (file.streamed)
+			{
+				// the consumer compresses it when its turn comes
+				streamed[file.index] = true;
+				compressor.emplace_result(std::make_pair(name, std::vector<uint8_t>()), 0);
+			}
+			else if (auto payload = reusable_payload(base, name, file.data))
+			{
+				// skips the workers, but keeps its place in the archive
+				compressor.emplace_result(std::make_pair(name, std::vector<uint8_t>(payload->begin(), payload->end())), cost);
+				buffers.give(std::move(file.data));
+				reused++;
+			}
+			else
+				compressor.emplace(std::make_pair(name, std::move(file.data)), cost);
+		};
+		loader.run(admit, deliver, [](uint64_t size) { return needs_streaming(size); });
+	}
+	catch (...)
 	{
-		while (compressor.memory_usage() > MAX_MEMORY_USAGE)
-			std::this_thread::sleep_for(std::chrono::milliseconds(100));
-		compressor.emplace(std::make_pair(filepath.filename().string(), load_file(filepath)));
+		// stopping wakes up the consumer waiting in pop()
+		error = std::current_exception();
+		compressor.stop();
 	}
 }
 
 template <typename T>
-void pack_fpk_async(const std::deque<fs::path>& files, const fs::path& outpath, int version)
+void pack_fpk_async(const std::deque<fs::path>& files, const fs::path& outpath, int version, const FpkReader* base, CompressionCache* cache)
 {
 	if (options.verbose)
 		std::cout << "Starting multi threaded packing...\n";
@@ -311,41 +860,80 @@ void pack_fpk_async(const std::deque<fs::path>& files, const fs::path& outpath,
 	uint32_t fpk_header = file_count | (version >= 4 ? 0xA0000000 : 0x80000000);
 	write(fout, fpk_header);
 
-	MultithreadCompressor<zlc> compressor(options.threads);
+	// the input buffers go back to the loader once they are compressed, a small part of the budget
+	BufferPool buffers(std::min<size_t>(options.max_memory / 8, 64 << 20));
+	MultithreadCompressor<zlc> compressor(options.threads, options.max_memory);
+	compressor.buffers(&buffers);
+	StorePolicy::Stats store_stats;
+	compressor.task_report_callback([&](const std::string& name, const StorePolicy::Report& report) {
+		store_stats.add(report);
+		if (options.verbose)
+			std::cout << name + ": " + report.str() + '\n';
+	});
 	if (options.verbose)
 		compressor.task_started_callack(compression_started_callback);
-	compressor.start(MultithreadCompressor<zlc>::Mode::compress);
-
-	std::thread producer(file_loader, std::ref(files), std::ref(compressor));
+	// results are written in input order, so the archive is the same as the single threaded one
+	compressor.cache(cache);
+	compressor.start(MultithreadCompressor<zlc>::Mode::compress, MultithreadCompressor<zlc>::Order::input);
+
+	std::vector<fs::path> paths(files.begin(), files.end());
+	FileLoader loader(paths, buffers);
+	std::exception_ptr load_error;
+	std::vector<uint8_t> streamed(paths.size()); // set by the producer before the placeholder result is queued
+	size_t reused = 0;
+	std::thread producer(file_loader, std::ref(loader), std::ref(paths), std::ref(buffers), std::ref(compressor),
+		base, std::ref(streamed), std::ref(reused), std::ref(load_error));
 
 	std::multimap<uint32_t, T> toc_map;
 	std::pair<std::string, std::vector<uint8_t>> result;
 	uint32_t h;
 	uint32_t files_processed = 0;
-	while (files_processed < file_count)
+	zlc::workspace workspace; // for the streamed files
+	try
 	{
-		while (!compressor.try_pop(result))
-			std::this_thread::sleep_for(std::chrono::milliseconds(100));
-
-		h = hash(result.first);
-		toc_map.insert(std::make_pair(h, T(fout.tellp(), result.second.size(), result.first, h)));
+		while (files_processed < file_count)
+		{
+			result = compressor.pop();
 
-		write(fout, result.second);
+			h = hash(result.first);
+			const uint32_t offset = fout.tellp();
+			uint32_t size = result.second.size();
+			if (streamed[files_processed])
+				size = pack_streamed(paths[files_processed], fout, workspace, store_stats);
+			else
+				write(fout, result.second);
+			toc_map.insert(std::make_pair(h, T(offset, size, result.first, h)));
+			buffers.give(std::move(result.second));
 
-		files_processed++;
+			files_processed++;
 
-		printf("%.1f%%\n", (float)(100 * files_processed) / (float)file_count);
+			printf("%.1f%%\n", (float)(100 * files_processed) / (float)file_count);
+		}
+	}
+	catch (...)
+	{
+		compressor.stop();
+		producer.join();
+		if (load_error)
+			std::rethrow_exception(load_error);
+		throw;
 	}
-
-	FpkTRL trl;
-	trl.toc_offset = fout.tellp();
-	trl.key = options.key;
-
-	for (auto& [hash, entry] : toc_map)
-		write(fout, entry);
-
-	write(fout, trl);
 	producer.join();
+	compressor.stop_wait();
+	if (options.verbose)
+	{
+		print_read_throughput(loader);
+		print_memory_usage(compressor);
+		print_buffer_stats(buffers);
+		print_store_stats(store_stats);
+	}
+
+	write_toc(fout, toc_map);
+	truncate_archive(fout, outpath);
+	if (base && options.verbose)
+		std::cout << "Reused " << reused << " of " << file_count << " payloads from the base archive.\n";
+	if (cache && options.verbose)
+		print_cache_stats(*cache);
 }
 
 void pack_fpk(const fs::path& inpath, const fs::path& outpath, int version)
@@ -383,16 +971,42 @@ void pack_fpk(const fs::path& inpath, const fs::path& outpath, int version)
 		else
 			std::cout << "Warning: Invalid file type of file " << entry.path() << ". This entry will be ignored.\n";
 	}
+	// the directory order depends on the file system, sort for reproducible archives
+	std::sort(files.begin(), files.end());
+
+	std::optional<FpkReader> base;
+	if (!options.base.empty())
+	{
+		// the base stays mapped while the output is written
+		if (fs::exists(outpath) && fs::equivalent(options.base, outpath))
+			throw std::runtime_error("The base archive cannot be overwritten by the new archive!");
+		base.emplace(options.base, version);
+	}
+	const FpkReader* base_reader = base ? &*base : nullptr;
+
+	// blobs are only valid for the same compressions and level
+	std::optional<CompressionCache> cache;
+	if (!options.cache_dir.empty() && (options.zlc || options.rle))
+	{
+		std::string params = options.zlc ? "zlc" + std::to_string(options.level) : "raw";
+		if (options.rle)
+			params += "-rle";
+		// stored files are not cached, but the estimate decides which results are
+		if (options.zlc && options.store != StoreMode::NEVER)
+			params += options.store == StoreMode::AUTO ? "-store" : "-fallback";
+		cache.emplace(options.cache_dir, options.cache_size, params);
+	}
+	CompressionCache* cache_ptr = cache ? &*cache : nullptr;
 
 	if (options.threads != 1) {
 		if (version <= 2) {
-			pack_fpk_async<FpkV2Entry>(files, outpath, version);
+			pack_fpk_async<FpkV2Entry>(files, outpath, version, base_reader, cache_ptr);
 		}
 		else if (version == 3) {
-			pack_fpk_async<FpkV3Entry>(files, outpath, version);
+			pack_fpk_async<FpkV3Entry>(files, outpath, version, base_reader, cache_ptr);
 		}
 		else if (version == 4) {
-			pack_fpk_async<FpkV4Entry>(files, outpath, version);
+			pack_fpk_async<FpkV4Entry>(files, outpath, version, base_reader, cache_ptr);
 		}
 		else {
 			throw std::runtime_error("Unsupported FPK version: " + std::to_string(version));
@@ -400,13 +1014,13 @@ void pack_fpk(const fs::path& inpath, const fs::path& outpath, int version)
 	}
 	else {
 		if (version <= 2) {
-			pack_fpk_sync<FpkV2Entry>(files, outpath, version);
+			pack_fpk_sync<FpkV2Entry>(files, outpath, version, base_reader, cache_ptr);
 		}
 		else if (version == 3) {
-			pack_fpk_sync<FpkV3Entry>(files, outpath, version);
+			pack_fpk_sync<FpkV3Entry>(files, outpath, version, base_reader, cache_ptr);
 		}
 		else if (version == 4) {
-			pack_fpk_sync<FpkV4Entry>(files, outpath, version);
+			pack_fpk_sync<FpkV4Entry>(files, outpath, version, base_reader, cache_ptr);
 		}
 		else {
 			throw std::runtime_error("Unsupported FPK version: " + std::to_string(version));
@@ -422,17 +1036,43 @@ void print_usage()
 		"Usage: <me> [options] <input>\n"
 		"Options should be from the following list:\n\n"
 		"Modes:\n"
-		"  -e, --extract       extract PFK archive (default)\n"
+		"  -e, --extract [names...]\n"
+		"                      extract PFK archive (default), optionally only the named entries\n"
 		"  -p, --pack          pack FPK archive\n"
-		"  -l, --list          only list files in the archive\n\n"
+		"  -l, --list          only list files in the archive\n"
+		"      --test          decode every entry in memory and report the broken ones, the\n"
+		"                      exit code is 1 if there are any\n\n"
+		"Extraction options:\n"
+		"      --fsync         flush every extracted file to the disk before it counts as written\n"
+		"      --no-sync       leave flushing to the operating system (default)\n\n"
+		"Listing options:\n"
+		"  -f, --format <fmt>  output format of the listing: tsv or json (default: tsv)\n\n"
 		"Compressions:\n"
 		"  -z, --zlc           enable ZLC compression (default)\n"
 		"  -Z, --Zlc           disable ZLC compression\n"
 		"  -r, --rle           enable RLE compression\n"
-		"  -R, --Rle           disable RLE compression (default)\n\n"
+		"  -R, --Rle           disable RLE compression (default)\n"
+		"  -s, --store <mode>  when files are stored raw instead of compressed (default: auto)\n"
+		"                      auto: skip files that a sample and a compressed prefix show to be\n"
+		"                      incompressible (e.g. OGG, PNG), store results that are not smaller\n"
+		"                      fallback: compress everything, store results that are not smaller\n"
+		"                      never: always keep the compressed result\n\n"
 		"Packing options:\n"
-		"  -t, --threads <n>   number of threads to use while compression (default: #system threads)\n"
-		"  -k, --key <key>     the key to use while obfuscating (default: 0)\n\n"
+		"  -t, --threads <n>   number of threads to use while (de)compression (default: #system threads)\n"
+		"  -lvl, --level <n>   ZLC compression level from 1 (fast) to 9 (smallest) (default: 5)\n"
+		"                      1-3: greedy, 4-6: lazy matching, 7-9: optimal parsing\n"
+		"  -k, --key <key>     the key to use while obfuscating (default: 0)\n"
+		"  -b, --base <fpk>    previous version of the archive, unchanged files reuse its\n"
+		"                      compressed payloads instead of being compressed again\n"
+		"  -c, --cache <dir>   directory of a compression cache that can be shared between runs\n"
+		"  -cs, --cache-size <size>\n"
+		"                      size limit of the cache, the least recently used payloads are\n"
+		"                      removed first, accepts K, M and G suffixes (default: 4G)\n\n"
+		"Memory options:\n"
+		"  -m, --max-memory <size>\n"
+		"                      memory budget of the (de)compression threads, accepts K, M and G\n"
+		"                      suffixes (default: 2G). Larger files and entries are (de)compressed\n"
+		"                      piece by piece with a few MiB, larger files skip RLE, cache and base.\n\n"
 		"General options:\n"
 		"  -h, --help          show this help message and exit\n"
 		"  -o, --output        set the output path\n"
@@ -508,6 +1148,11 @@ public:
 	{
 		return pos < argc;
 	}
+
+	int remaining()
+	{
+		return argc - pos;
+	}
 };
 
 std::string create_output_from_input(const std::string& input)
@@ -536,13 +1181,24 @@ void parse_args(int argc, const char** argv)
 		if (arg == "-h" || arg == "--help")
 			print_usage_and_exit();
 		else if (arg == "-e" || arg == "--extract")
+		{
 			options.mode = ExecutionMode::EXTRACT;
+			// optional entry names, the last argument is always the input
+			while (args.remaining() > 1 && !args.peek().starts_with('-'))
+				options.entries.push_back(args.next());
+		}
 		else if (arg == "-p" || arg == "--pack")
 			options.mode = ExecutionMode::PACK;
 		else if (arg == "-l" || arg == "--list")
 			options.mode = ExecutionMode::LIST;
+		else if (arg == "--test")
+			options.mode = ExecutionMode::TEST;
 		else if (arg == "-v" || arg == "--verbose")
 			options.verbose = true;
+		else if (arg == "--fsync")
+			options.fsync = true;
+		else if (arg == "--no-sync")
+			options.fsync = false;
 		else if (arg == "-z" || arg == "--zlc")
 			options.zlc = true;
 		else if (arg == "-Z" || arg == "--Zlc")
@@ -559,8 +1215,67 @@ void parse_args(int argc, const char** argv)
 			{
 				if (arg == "-t" || arg == "--threads")
 					options.threads = args.next_ulong();
+				else if (arg == "-lvl" || arg == "--level")
+				{
+					options.level = args.next_ulong();
+					if (options.level < zlc::MIN_LEVEL || options.level > zlc::MAX_LEVEL)
+						print_usage_error_and_exit("The compression level must be between "
+							+ std::to_string(zlc::MIN_LEVEL) + " and " + std::to_string(zlc::MAX_LEVEL) + '!');
+				}
+				else if (arg == "-m" || arg == "--max-memory")
+				{
+					std::string value = args.next();
+					try
+					{
+						options.max_memory = parse_size(value);
+					}
+					catch (const std::exception& exc)
+					{
+						print_usage_error_and_exit("Invalid memory size: " + value);
+					}
+					if (options.max_memory == 0)
+						print_usage_error_and_exit("The memory budget must be greater than 0!");
+				}
+				else if (arg == "-b" || arg == "--base")
+					options.base = args.next();
+				else if (arg == "-c" || arg == "--cache")
+					options.cache_dir = args.next();
+				else if (arg == "-cs" || arg == "--cache-size")
+				{
+					std::string value = args.next();
+					try
+					{
+						options.cache_size = parse_size(value);
+					}
+					catch (const std::exception& exc)
+					{
+						print_usage_error_and_exit("Invalid cache size: " + value);
+					}
+				}
+				else if (arg == "-s" || arg == "--store")
+				{
+					std::string mode = str_tolower(args.next());
+					if (mode == "auto")
+						options.store = StoreMode::AUTO;
+					else if (mode == "fallback")
+						options.store = StoreMode::FALLBACK;
+					else if (mode == "never")
+						options.store = StoreMode::NEVER;
+					else
+						print_usage_error_and_exit("Unknown store mode: " + mode);
+				}
 				else if (arg == "-k" || arg == "--key")
 					options.key = args.next_ulong();
+				else if (arg == "-f" || arg == "--format")
+				{
+					std::string format = str_tolower(args.next());
+					if (format == "tsv")
+						options.list_format = ListFormat::TSV;
+					else if (format == "json")
+						options.list_format = ListFormat::JSON;
+					else
+						print_usage_error_and_exit("Unknown listing format: " + format);
+				}
 				else if (arg == "-o" || arg == "--output")
 					options.output = args.next();
 				else if (arg == "-ver" || arg == "--version")
@@ -596,7 +1311,7 @@ void parse_args(int argc, const char** argv)
 	}
 
 	// check for output path if necessary
-	if (options.mode != ExecutionMode::LIST && options.output.length() == 0) 
+	if (options.mode != ExecutionMode::LIST && options.mode != ExecutionMode::TEST && options.output.length() == 0) 
 		options.output = create_output_from_input(options.input);
 }
 
@@ -627,6 +1342,9 @@ int main(int argc, const char** argv)
 		case ExecutionMode::LIST:
 			std::cout << "listing";
 			break;
+		case ExecutionMode::TEST:
+			std::cout << "test";
+			break;
 		default:
 			std::cout << "unknown mode wtf\n";
 			return 1;
@@ -634,7 +1352,7 @@ int main(int argc, const char** argv)
 		std::cout << " mode with the following options:\n"
 			<< "Input: " << options.input << '\n';
 
-		if (options.mode != ExecutionMode::LIST)
+		if (options.mode != ExecutionMode::LIST && options.mode != ExecutionMode::TEST)
 			std::cout << "Output: " << options.output << '\n';
 
 		std::cout << "Verbose: true\n";
@@ -648,6 +1366,7 @@ int main(int argc, const char** argv)
 				std::cout << "auto\n";
 			std::cout
 				<< "ZLC Compression: " << bool_to_str(options.zlc) << '\n'
+				<< "ZLC Level: " << options.level << '\n'
 				<< "RLE Compression: " << bool_to_str(options.rle) << '\n'
 				<< "Obfuscation key: 0x" << std::right << std::hex << std::setfill('0') << std::setw(8) << options.key << std::dec << std::setfill(' ') << std::left << std::endl;
 		}
@@ -655,6 +1374,7 @@ int main(int argc, const char** argv)
 		std::cout << std::endl;
 	}
 
+	int exit_code = 0;
 	try
 	{
 		if (options.mode == ExecutionMode::EXTRACT)
@@ -667,9 +1387,15 @@ int main(int argc, const char** argv)
 		}
 		else if (options.mode == ExecutionMode::LIST)
 		{
-			// TODO
-			printf("Not implemented");
+			list_fpk(options.input, options.output, options.version);
 		}
+		else if (options.mode == ExecutionMode::TEST)
+		{
+			if (!test_fpk(options.input, options.version))
+				exit_code = 1;
+		}
+		if (options.verbose)
+			print_process_stats();
 	}
 	catch (const std::ios::failure& fail)
 	{
@@ -682,5 +1408,5 @@ int main(int argc, const char** argv)
 		return 1;
 	}
 
-	return 0;
+	return exit_code;
 }
\ No newline at end of file
@@ -0,0 +1,334 @@
+// Regression tests for the codecs and the archive reader. Every test builds its input itself,
+// archives are written by hand into the temp directory. Exits with 1 if a test fails.
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <functional>
+#include <filesystem>
+
+#include <cstdint>
+#include <cstring>
+
+#include "Fpk.hpp"
+#include "FpkReader.hpp"
+#include "ZLC.hpp"
+#include "RLE.hpp"
+#include "Options.hpp"
+#include "MultithreadCompressor.hpp"
+
+Options options; // defaults of the command line, read by MultithreadCompressor
+
+namespace fs = std::filesystem;
+
+#define CHECK(cond) do { if (!(cond)) throw std::runtime_error(std::string(__FILE__) + ":" + std::to_string(__LINE__) + ": " #cond); } while (0)
+
+static std::vector<uint8_t> random_bytes(size_t size, uint32_t seed)
+{
+	std::mt19937 rng(seed);
+	std::vector<uint8_t> data(size);
+	for (auto& b : data)
+		b = (uint8_t)rng();
+	return data;
+}
+
+static std::vector<uint8_t> text_bytes(size_t size)
+{
+	static const char words[] = "the quick brown fox jumps over the lazy dog ";
+	std::vector<uint8_t> data(size);
+	for (size_t i = 0; i < size; i++)
+		data[i] = words[i % (sizeof(words) - 1)];
+	return data;
+}
+
+// Scenario script lines built from a small vocabulary, skewed towards the first words.
+// Small vocabularies give many matches of every length, where the parsers differ most.
+static std::vector<uint8_t> script_bytes(size_t size, uint32_t seed, size_t vocabulary)
+{
+	static const char* syllables[] = { "ka", "ki", "ku", "ke", "ko", "sa", "shi", "su", "ta", "chi",
+		"to", "na", "ni", "no", "ha", "ma", "mi", "ra", "ri", "n", "the", "and", "you" };
+	static const char* names[] = { "Kotone", "Nagisa", "Sakura", "Yuu", "Teacher" };
+
+	std::mt19937 rng(seed);
+	std::vector<std::string> words(vocabulary);
+	for (auto& word : words)
+	{
+		for (size_t n = 1 + rng() % 3; n; n--)
+			word += syllables[rng() % std::size(syllables)];
+	}
+
+	std::string text;
+	while (text.size() < size)
+	{
+		if (rng() % 8 == 0)
+		{
+			text += "@se storage=se" + std::to_string(rng() % 100) + "\r\n";
+			continue;
+		}
+		text += std::string("[") + names[rng() % std::size(names)] + "]\r\n\"";
+		for (size_t n = 4 + rng() % 12; n; n--)
+			text += words[(rng() % vocabulary) * (rng() % vocabulary) / vocabulary] + ' ';
+		text += "\"\r\n";
+	}
+	return std::vector<uint8_t>(text.begin(), text.begin() + size);
+}
+
+// An archive with the plain layout: header, FpkEntry2 TOC right after it, then the payloads.
+static fs::path write_archive(const std::string& name, const std::vector<std::pair<std::string, std::vector<uint8_t>>>& entries)
+{
+	fs::path path = fs::temp_directory_path() / name;
+	std::ofstream out(path, std::ios::binary);
+	uint32_t header = (uint32_t)entries.size();
+	out.write((const char*)&header, sizeof(header));
+
+	uint32_t offset = (uint32_t)(sizeof(header) + entries.size() * sizeof(FpkEntry2));
+	for (auto& [fn, payload] : entries)
+	{
+		FpkEntry2 entry{ offset, (uint32_t)payload.size(), {} };
+		std::strncpy(entry.filename, fn.c_str(), sizeof(entry.filename) - 1);
+		out.write((const char*)&entry, sizeof(entry));
+		offset += (uint32_t)payload.size();
+	}
+	for (auto& [fn, payload] : entries)
+		out.write((const char*)payload.data(), payload.size());
+	if (!out)
+		throw std::runtime_error("Unable to write " + path.string());
+	return path;
+}
+
+// A --base repack of files the store policy left raw reuses them instead of compressing them again.
+static void base_reuses_stored_entries()
+{
+	const auto media = random_bytes(100000, 1);
+	const auto text = text_bytes(50000);
+	const auto path = write_archive("betterfpk_base_stored.fpk", {
+		{ "music.ogg", media },
+		{ "script.txt", zlc::compress(text, 5) } });
+	{
+		FpkReader base(path, 2);
+
+		auto stored = base.reusable_payload("music.ogg", media, true, false, true);
+		CHECK(stored);
+		CHECK(std::equal(stored->begin(), stored->end(), media.begin(), media.end()));
+		CHECK(!base.reusable_payload("music.ogg", media, true, false, false));
+		CHECK(base.reusable_payload("music.ogg", media, false, false, false));
+
+		auto changed = media;
+		changed[changed.size() / 2] ^= 1;
+		CHECK(!base.reusable_payload("music.ogg", changed, true, false, true));
+
+		auto compressed = base.reusable_payload("script.txt", text, true, false, true);
+		CHECK(compressed);
+		CHECK(zlc::decompress(*compressed) == text);
+		CHECK(!base.reusable_payload("script.txt", text, false, false, false));
+	}
+	fs::remove(path);
+}
+
+// The size in a ZLC2 header can contain a byte run, the RLE layer must not turn it into a run
+// or the size of the file is not visible without decoding (--list, memory costs).
+static void rle_keeps_zlc_header_literal()
+{
+	// 1000 bytes: E8 03 00 00, then the flag byte of 8 literals and a literal 0
+	std::vector<uint8_t> data = text_bytes(1000);
+	for (size_t i = 0; i < 8; i++)
+		data[i] = (uint8_t)i;
+	const auto compressed = zlc::compress(data, 5);
+	CHECK(std::all_of(compressed.begin() + 6, compressed.begin() + 10, [](uint8_t b) { return b == 0; }));
+
+	const auto packed = rle::compress(compressed);
+	auto info = peek_payload(packed);
+	CHECK(std::string_view(info.compression) == "rle+zlc");
+	CHECK(info.original_size == data.size());
+	CHECK(rle::decompress(packed) == compressed);
+}
+
+// The levels from the lazy ones up are meant to trade time for size, a shortcut in one of the
+// optimal levels must not make it compress worse than a faster level.
+static void levels_from_5_to_9_never_grow()
+{
+	for (size_t vocabulary : { 20, 300 })
+	{
+		const auto data = script_bytes(256 << 10, 1, vocabulary);
+		size_t previous = data.size() * 2;
+		for (int level = 5; level <= 9; level++)
+		{
+			const size_t size = zlc::compress(data, level).size();
+			CHECK(size <= previous);
+			previous = size;
+		}
+	}
+}
+
+// Every level has to decode to its input, including the inputs without any match or without a header.
+static void levels_round_trip()
+{
+	const std::vector<std::vector<uint8_t>> inputs = {
+		{},
+		{ 42 },
+		std::vector<uint8_t>(10000, 0),
+		text_bytes(70000),
+		random_bytes(30000, 2),
+		script_bytes(100000, 3, 50),
+	};
+	zlc::workspace ws;
+	for (int level = zlc::MIN_LEVEL; level <= zlc::MAX_LEVEL; level++)
+	{
+		for (auto& input : inputs)
+		{
+			const auto compressed = zlc::compress(input, level, ws);
+			CHECK(zlc::decoded_size(compressed) == input.size());
+			CHECK(zlc::decompress(compressed) == input);
+
+			std::vector<uint8_t> output(zlc::compress_bound(input.size()));
+			auto result = zlc::compress(input, output, level, ws);
+			CHECK(result);
+			CHECK(std::equal(output.begin(), output.begin() + result.size, compressed.begin(), compressed.end()));
+		}
+	}
+	std::vector<uint8_t> output(zlc::compress_bound(0));
+	CHECK(zlc::compress(std::span<const uint8_t>(), output, zlc::MAX_LEVEL + 1, ws).error == codec_error::invalid_argument);
+}
+
+// The chunks of compress_chunk stitched together and the stream of compress_stream are the same
+// bytes compress makes of the whole input, no matter how the input is read.
+static void chunked_matches_single_pass()
+{
+	// not a multiple of CHUNK_SIZE, so the last chunk is short
+	const auto data = script_bytes(2 * zlc::CHUNK_SIZE + 300000, 4, 100);
+	const size_t chunks = zlc::chunk_count(data.size());
+	CHECK(chunks == 3);
+
+	std::mt19937 rng(5);
+	zlc::workspace ws;
+	for (int level : { 1, 5, 9 })
+	{
+		const auto single = zlc::compress(data, level, ws);
+
+		std::vector<zlc::chunk> parts(chunks);
+		for (size_t i = chunks; i-- > 0;) // the order must not matter
+			parts[i] = zlc::compress_chunk(data, i, level, ws);
+		CHECK(zlc::stitch(data.size(), parts) == single);
+
+		std::vector<uint8_t> streamed;
+		size_t pos = 0;
+		const uint64_t total = zlc::compress_stream(
+			[&](std::span<uint8_t> buffer) {
+				size_t n = std::min<size_t>({ buffer.size(), data.size() - pos, 1 + rng() % 700000 });
+				std::memcpy(buffer.data(), data.data() + pos, n);
+				pos += n;
+				return n;
+			},
+			[&](std::span<const uint8_t> bytes) { streamed.insert(streamed.end(), bytes.begin(), bytes.end()); },
+			level, ws);
+		CHECK(total == data.size());
+		const auto header = zlc::make_header(total);
+		std::copy(header.begin(), header.end(), streamed.begin());
+		CHECK(streamed == single);
+	}
+}
+
+// Feeds the stream in random pieces into random output buffers until the decoder is done, like the
+// extractor it stops there (a trailing flag byte without tokens may be left).
+template <typename Decoder>
+static std::vector<uint8_t> decode_in_pieces(const std::vector<uint8_t>& stream, uint32_t seed)
+{
+	std::mt19937 rng(seed);
+	Decoder decoder(stream.size());
+	std::vector<uint8_t> output, buffer;
+	std::span<const uint8_t> rest(stream);
+	for (size_t rounds = 0; !decoder.done(); rounds++)
+	{
+		CHECK(rounds < 10 * (stream.size() + 10)); // no progress
+		std::span<const uint8_t> piece = rest.first(std::min<size_t>(rest.size(), rng() % 300));
+		buffer.resize(1 + rng() % 5000);
+		const size_t before = piece.size();
+		auto result = decoder.decode(piece, buffer);
+		CHECK(result);
+		rest = rest.subspan(before - piece.size());
+		output.insert(output.end(), buffer.begin(), buffer.begin() + result.size);
+	}
+	CHECK(decoder.written() == output.size());
+	return output;
+}
+
+// The streaming decoders give the same bytes as a full decode, wherever the input and output are split.
+static void streaming_decode_matches_full_decode()
+{
+	const std::vector<std::vector<uint8_t>> inputs = {
+		{},
+		{ 7, 7 },
+		text_bytes(50000),
+		script_bytes(200000, 6, 30),
+		random_bytes(20000, 7),
+		std::vector<uint8_t>(40000, 0),
+	};
+	uint32_t seed = 8;
+	for (auto& input : inputs)
+	{
+		const auto compressed = zlc::compress(input, 6);
+		CHECK(decode_in_pieces<zlc::decoder>(compressed, seed++) == zlc::decompress(compressed));
+		CHECK(decode_in_pieces<zlc::decoder>(input, seed++) == input); // passed through
+
+		const auto packed = rle::compress(compressed);
+		CHECK(decode_in_pieces<rle::decoder>(packed, seed++) == rle::decompress(packed));
+		CHECK(decode_in_pieces<rle::decoder>(input, seed++) == input);
+	}
+}
+
+// In input order the results come out in the order of emplace even when a large early task
+// finishes last, and every one of them still decodes to its input.
+static void multithreaded_input_order()
+{
+	std::vector<std::vector<uint8_t>> inputs;
+	inputs.push_back(script_bytes(2 * zlc::CHUNK_SIZE + 1000, 9, 40)); // chunked if there are several workers
+	for (uint32_t i = 0; i < 10; i++)
+		inputs.push_back(script_bytes(1000 + i * 3000, 10 + i, 40));
+
+	MultithreadCompressor<zlc> compressor(4);
+	compressor.start(MultithreadCompressor<zlc>::Mode::compress, MultithreadCompressor<zlc>::Order::input);
+	for (size_t i = 0; i < inputs.size(); i++)
+		compressor.emplace({ "file" + std::to_string(i), inputs[i] });
+	for (size_t i = 0; i < inputs.size(); i++)
+	{
+		auto result = compressor.pop();
+		CHECK(result.first == "file" + std::to_string(i));
+		CHECK(zlc::decompress(result.second) == inputs[i]);
+	}
+	compressor.stop_wait();
+}
+
+int main()
+{
+	const std::pair<const char*, std::function<void()>> tests[] = {
+		{ "base_reuses_stored_entries", base_reuses_stored_entries },
+		{ "rle_keeps_zlc_header_literal", rle_keeps_zlc_header_literal },
+		{ "levels_from_5_to_9_never_grow", levels_from_5_to_9_never_grow },
+		{ "levels_round_trip", levels_round_trip },
+		{ "chunked_matches_single_pass", chunked_matches_single_pass },
+		{ "streaming_decode_matches_full_decode", streaming_decode_matches_full_decode },
+		{ "multithreaded_input_order", multithreaded_input_order },
+	};
+
+	int failed = 0;
+	for (auto& [name, test] : tests)
+	{
+		try
+		{
+			test();
+			std::cout << "ok      " << name << '\n';
+		}
+		catch (const std::exception& exc)
+		{
+			std::cout << "FAILED  " << name << ": " << exc.what() << '\n';
+			failed++;
+		}
+	}
+	std::cout << (std::size(tests) - failed) << " of " << std::size(tests) << " tests passed.\n";
+	return failed ? 1 : 0;
+}
\ No newline at end of file